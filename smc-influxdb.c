@@ -19,11 +19,27 @@
  */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
+#include <fnmatch.h>
 #include <IOKit/IOKitLib.h>
 
+#include <stdlib.h>
+#include <math.h>
 #include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/sysctl.h>
 
 static io_connect_t conn;
 
@@ -36,6 +52,8 @@ static io_connect_t conn;
 #define SMC_CMD_READ_PLIMIT 11
 #define SMC_CMD_READ_VERS 12
 
+#define SMC_RESULT_KEY_NOT_FOUND 132
+
 // key values
 typedef struct {
     char major;
@@ -115,26 +133,6 @@ void _ultostr(char* str, UInt32 val)
 
 
 
-float _strtof( char* str, int size, int e)
-{
-    float total = 0;
-    int i;
-    
-    for (i = 0; i < size; i++)
-    {
-        if (i == (size - 1))
-            total += (str[i] & 0xff) >> e;
-        else
-            total += str[i] << (size - 1 - i) * (8 - e);
-    }
-    
-    total += (str[size-1] & 0x03) * 0.25;
-    
-    return total;
-}
-
-
-
 kern_return_t SMCOpen(void)
 {
     kern_return_t result;
@@ -174,27 +172,209 @@ kern_return_t SMCClose()
 
 
 
+// time spent in SMC round trips, cumulative, the read stage of the collector line
+long usRead = 0;
+
+
+
+long _monotonicUs(void)
+{
+    struct timespec spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec * 1000000 + spec.tv_nsec / 1000;
+}
+
+
+
 kern_return_t SMCCall(int index, SMCKeyData_t* inputStructure, SMCKeyData_t* outputStructure)
 {
     size_t structureInputSize;
     size_t structureOutputSize;
+    kern_return_t result;
+    long started = _monotonicUs();
 
     structureInputSize = sizeof(SMCKeyData_t);
     structureOutputSize = sizeof(SMCKeyData_t);
 
 #if MAC_OS_X_VERSION_10_5
-    return IOConnectCallStructMethod(conn, index,
+    result = IOConnectCallStructMethod(conn, index,
         // inputStructure
         inputStructure, structureInputSize,
         // ouputStructure
         outputStructure, &structureOutputSize);
 #else
-    return IOConnectMethodStructureIStructureO(conn, index,
+    result = IOConnectMethodStructureIStructureO(conn, index,
         structureInputSize, /* structureInputSize */
         &structureOutputSize, /* structureOutputSize */
         inputStructure, /* inputStructure */
         outputStructure); /* ouputStructure */
 #endif
+
+    usRead += _monotonicUs() - started;
+    return result;
+}
+
+
+
+// -P key info cache, a sorted table of what READ_KEYINFO returned for every key this host was asked for
+#define KEYCACHE_MAGIC 0x534d434b
+#define KEYCACHE_VERSION 1
+#define MAX_KEYINFO 512
+
+typedef struct {
+    UInt32 magic;
+    UInt32 version;
+    UInt32 count;
+    UInt32 checksum;
+    char model[64];
+} KeyCacheHeader_t;
+
+// dataSize 0 records a key this SMC does not have
+typedef struct {
+    UInt32 key;
+    UInt32 dataSize;
+    UInt32 dataType;
+} KeyCacheEntry_t;
+
+char* keyCachePath = NULL;
+const KeyCacheEntry_t* keyCacheMap = NULL;
+UInt32 keyCacheCount = 0;
+void* keyCacheBase = NULL;
+size_t keyCacheSize = 0;
+KeyCacheEntry_t keyCacheNew[MAX_KEYINFO];
+int nKeyCacheNew = 0;
+
+
+
+// FNV-1a over the entries, a torn or foreign file is rebuilt rather than trusted
+UInt32 _keyCacheChecksum(const KeyCacheEntry_t* entries, UInt32 count)
+{
+    const unsigned char* p = (const unsigned char*)entries;
+    size_t i, size = count * sizeof(KeyCacheEntry_t);
+    UInt32 hash = 2166136261u;
+
+    for (i = 0; i < size; i++) {
+        hash = ( hash ^ p[i] ) * 16777619u;
+    }
+    return hash;
+}
+
+
+
+void _keyCacheModel(char* model, size_t size)
+{
+    memset(model, 0, size);
+    if ( sysctlbyname("hw.model", model, &size, NULL, 0) != 0 ) { strcpy(model, "Unknown"); }
+}
+
+
+
+// map the cache read-only, on any mismatch it is left unmapped and rebuilt at exit
+int loadKeyCache(const char* path)
+{
+    const KeyCacheHeader_t* header;
+    struct stat sb;
+    void* map;
+    char model[64];
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if ( fd == -1 ) { return -1; }
+    if ( fstat(fd, &sb) != 0 || sb.st_size < sizeof(KeyCacheHeader_t) ) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( map == MAP_FAILED ) { return -1; }
+
+    header = map;
+    _keyCacheModel(model, sizeof(model));
+    if ( header->magic != KEYCACHE_MAGIC || header->version != KEYCACHE_VERSION ||
+         sb.st_size != sizeof(KeyCacheHeader_t) + header->count * sizeof(KeyCacheEntry_t) ||
+         strncmp(header->model, model, sizeof(model)) != 0 ||
+         _keyCacheChecksum((const KeyCacheEntry_t*)(header + 1), header->count) != header->checksum ) {
+        munmap(map, sb.st_size);
+        return -1;
+    }
+
+    if ( keyCacheBase != NULL ) { munmap(keyCacheBase, keyCacheSize); }
+    keyCacheBase = map;
+    keyCacheSize = sb.st_size;
+    keyCacheMap = (const KeyCacheEntry_t*)(header + 1);
+    keyCacheCount = header->count;
+    nKeyCacheNew = 0;
+    return 0;
+}
+
+
+
+const KeyCacheEntry_t* _keyCacheFind(UInt32 key)
+{
+    UInt32 lo = 0, hi = keyCacheCount, mid;
+    int i;
+
+    while ( lo < hi ) {
+        mid = ( lo + hi ) / 2;
+        if ( keyCacheMap[mid].key == key ) { return &keyCacheMap[mid]; }
+        if ( keyCacheMap[mid].key < key ) { lo = mid + 1; } else { hi = mid; }
+    }
+    for (i = 0; i < nKeyCacheNew; i++) {
+        if ( keyCacheNew[i].key == key ) { return &keyCacheNew[i]; }
+    }
+    return NULL;
+}
+
+
+
+int _keyCacheCompare(const void* a, const void* b)
+{
+    UInt32 x = ((const KeyCacheEntry_t*)a)->key;
+    UInt32 y = ((const KeyCacheEntry_t*)b)->key;
+
+    return x < y ? -1 : x > y;
+}
+
+
+
+// merge keys resolved this run into the cache, written aside and renamed so a mapped reader never sees a partial file
+int saveKeyCache(const char* path)
+{
+    static KeyCacheEntry_t entries[MAX_KEYINFO * 2];
+    KeyCacheHeader_t header;
+    char tmpPath[1024];
+    UInt32 count = 0;
+    int fd, ok;
+
+    if ( nKeyCacheNew == 0 ) { return 0; }
+    if ( keyCacheCount + nKeyCacheNew > sizeof(entries) / sizeof(entries[0]) ) { return -1; }
+
+    memcpy(entries, keyCacheMap, keyCacheCount * sizeof(KeyCacheEntry_t));
+    count = keyCacheCount;
+    memcpy(&entries[count], keyCacheNew, nKeyCacheNew * sizeof(KeyCacheEntry_t));
+    count += nKeyCacheNew;
+    qsort(entries, count, sizeof(KeyCacheEntry_t), _keyCacheCompare);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = KEYCACHE_MAGIC;
+    header.version = KEYCACHE_VERSION;
+    header.count = count;
+    header.checksum = _keyCacheChecksum(entries, count);
+    _keyCacheModel(header.model, sizeof(header.model));
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, (int)getpid());
+    fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ( fd == -1 ) { return -1; }
+    ok = write(fd, &header, sizeof(header)) == sizeof(header) &&
+         write(fd, entries, count * sizeof(KeyCacheEntry_t)) == count * sizeof(KeyCacheEntry_t);
+    ok = close(fd) == 0 && ok;
+    if ( !ok || rename(tmpPath, path) != 0 ) {
+        unlink(tmpPath);
+        return -1;
+    }
+
+    return 0;
 }
 
 
@@ -204,17 +384,36 @@ kern_return_t SMCReadKey(UInt32Char_t key, SMCVal_t* val)
     kern_return_t result;
     SMCKeyData_t inputStructure;
     SMCKeyData_t outputStructure;
+    const KeyCacheEntry_t* cached = NULL;
 
     memset(&inputStructure, 0, sizeof(SMCKeyData_t));
     memset(&outputStructure, 0, sizeof(SMCKeyData_t));
     memset(val, 0, sizeof(SMCVal_t));
 
     inputStructure.key = _strtoul(key, 4, 16);
-    inputStructure.data8 = SMC_CMD_READ_KEYINFO;
 
-    result = SMCCall(KERNEL_INDEX_SMC, &inputStructure, &outputStructure);
-    if (result != kIOReturnSuccess)
-        return result;
+    // with -P the key info comes from the cache, saving a round trip per key and all of them for absent keys
+    if ( keyCachePath != NULL ) { cached = _keyCacheFind(inputStructure.key); }
+    if ( cached != NULL ) {
+        if ( cached->dataSize == 0 ) { return kIOReturnSuccess; }
+        outputStructure.keyInfo.dataSize = cached->dataSize;
+        outputStructure.keyInfo.dataType = cached->dataType;
+    } else {
+        inputStructure.data8 = SMC_CMD_READ_KEYINFO;
+
+        result = SMCCall(KERNEL_INDEX_SMC, &inputStructure, &outputStructure);
+        if (result != kIOReturnSuccess)
+            return result;
+
+        // only a definite answer is cached, never a transient failure
+        if ( keyCachePath != NULL && nKeyCacheNew < MAX_KEYINFO &&
+             ( outputStructure.result == 0 || outputStructure.result == (char)SMC_RESULT_KEY_NOT_FOUND ) ) {
+            KeyCacheEntry_t* entry = &keyCacheNew[nKeyCacheNew++];
+            entry->key = inputStructure.key;
+            entry->dataSize = outputStructure.result == 0 ? outputStructure.keyInfo.dataSize : 0;
+            entry->dataType = outputStructure.keyInfo.dataType;
+        }
+    }
 
     val->dataSize = outputStructure.keyInfo.dataSize;
     _ultostr(val->dataType, outputStructure.keyInfo.dataType);
@@ -232,308 +431,2406 @@ kern_return_t SMCReadKey(UInt32Char_t key, SMCVal_t* val)
 
 
 char hostname[265];
-char hostTag[265];
+char hostTag[2048];
 long int ens;
 
+// rules from -x and -r, resolved to FourCC keys once at startup
+#define MAX_RULES 64
+
+UInt32 dropKeys[MAX_RULES];
+int nDropKeys = 0;
+char* dropPatterns[MAX_RULES];
+int nDropPatterns = 0;
+char* allowPatterns[MAX_RULES];
+int nAllowPatterns = 0;
+UInt32 renameKeys[MAX_RULES];
+char* renameNames[MAX_RULES];
+int nRenameKeys = 0;
+
+// all output and state buffers are static, nothing is allocated after startup
+char outBuf[65536];
+char batchBuf[65536];
+int batchLen = 0;
+char stateBuf[131072];
+int stateLen = 0;
+
+// -u sink, a bounded queue of whole lines drained to a Unix stream socket without blocking collection
+#define SINK_QUEUE_SIZE (1 << 20)
+#define SINK_BACKOFF_MIN 1000000
+#define SINK_BACKOFF_MAX 60000000
+
+char* sinkPath = NULL;
+int sinkFd = -1;
+char sinkQueue[SINK_QUEUE_SIZE];
+size_t sinkLen = 0;
+int sinkPartial = 0;
+long sinkRetryAt = 0;
+long sinkBackoff = SINK_BACKOFF_MIN;
+long nDropped = 0;
+long nWakeups = 0;
+
+// time spent decoding and formatting and handing batches to stdout or the socket, cumulative
+long usFormat = 0;
+long usSink = 0;
+
+volatile sig_atomic_t running = 1;
+volatile sig_atomic_t upgrading = 0;
+int snmpMode = 0;
+
+// what a collection reads
+#define WANT_CPU 0x01
+#define WANT_GPU 0x02
+#define WANT_SSD 0x04
+#define WANT_WIFI 0x08
+#define WANT_FAN 0x10
+#define WANT_ALL 0x20
+#define WANT_BATTERY 0x40
+#define WANT_POWER 0x80
+
+// batch accounting, persisted across runs in the -S state file
+int stateFd = -1;
+unsigned long batchSeq = 0;
+int nLines = 0;
+
+// per-sensor baselines for -k, one Welford accumulator per load level
+#define MAX_SENSORS 128
+#define LOAD_LEVELS 3
+#define BASELINE_WARMUP 30
+#define BASELINE_WINDOW 1440
+
+typedef struct {
+    long n;
+    double mean;
+    double m2;
+} Baseline_t;
+
+// AR(2) model with bias for -F, y[t] = a1 y[t-1] + a2 y[t-2] + c, fitted by recursive least squares
+#define RLS_ORDER 3
+#define RLS_FORGET 0.99
+#define RLS_MAX_TRACE ( 1000.0 * RLS_ORDER )
+
+typedef struct {
+    int n;
+    double y1;
+    double y2;
+    double forecast;
+    double theta[RLS_ORDER];
+    double P[RLS_ORDER][RLS_ORDER];
+} Forecast_t;
+
+typedef struct {
+    UInt32 key;
+    Baseline_t base[LOAD_LEVELS];
+    int run;
+    long lastTime;
+    double lastValue;
+    double energy;
+    double missed;
+    Forecast_t rls;
+    double cost;
+    int age;
+    int admitted;
+} SensorState_t;
+
+SensorState_t sensorState[MAX_SENSORS];
+int nSensorState = 0;
+int loadLevel = 0;
+double anomalySigma = 0.0;
+int anomalyRun = 3;
+int forecasting = 0;
+
+// -E load episodes per sensor group, the group is the sensor name up to its first dash
+#define MAX_GROUPS 32
+#define EPISODE_ALPHA 0.05
+#define EPISODE_LEVELS 3
+
+const double episodeLevel[EPISODE_LEVELS] = { 70.0, 80.0, 90.0 };
+
+typedef struct {
+    char group[16];
+    double baseline;
+    int active;
+    long start;
+    long last;
+    double peak;
+    double integral;
+    double above[EPISODE_LEVELS];
+    double current;
+    int seen;
+} Episode_t;
+
+Episode_t episodes[MAX_GROUPS];
+int nEpisodes = 0;
+double episodeRise = 0.0;
+
+// -B read budget in microseconds for the -A temperature table, a low priority key skipped this often is read even over budget
+#define SCHED_MAX_AGE 30
+#define COST_ALPHA 0.2
+
+double readBudget = 0.0;
+long collectStart = 0;
+int nSkipped = 0;
+
+// -m cap on distinct series, series admitted first keep their place
+int maxSeries = 0;
+int nAdmitted = 0;
+int nSuppressed = 0;
+
+// -N tables, base.1 temperatures and base.2 fans, filled from the readings as they are written
+typedef struct {
+    char key[5];
+    char sensor[32];
+    long value;
+    int index;
+} SnmpRow_t;
+
+SnmpRow_t snmpRows[2][MAX_SENSORS];
+int nSnmpRows[2];
+
+// readings further apart than this are a missed sample, not something to integrate across
+#define ENERGY_MAX_GAP 600
+
 
-float getSMCrpm(char* key)
+
+// escape a tag value for line protocol so consumers never see an ambiguous line
+int _escapeTag(char* dst, const char* src, int size)
 {
-    SMCVal_t val;
-    kern_return_t result;
-    float fval;
+    int i = 0;
 
-    result = SMCReadKey(key, &val);
-    if (result == kIOReturnSuccess) {
-        if (val.dataSize > 0) {
-            if (strcmp(val.dataType, "flt " ) == 0) {
-                memcpy(&fval,val.bytes,sizeof(float));
-                return fval;
-            } else if ( strcmp(val.dataType, "fpe2" ) == 0 ) {
-                fval = _strtof(val.bytes, val.dataSize, 2);
-                return fval;
-            }
+    while ( *src && i < size - 2 ) {
+        if ( *src == ',' || *src == '=' || *src == ' ' ) {
+            dst[i++] = '\\';
         }
+        dst[i++] = *src++;
     }
-    return -1.f;
+    dst[i] = '\0';
+
+    return i;
 }
 
-void influxSMCfans()
+
+
+// append to the batch being built, a line that does not fit is dropped whole
+int _batchAppend(const char* format, va_list args)
 {
-    kern_return_t result;
-    SMCVal_t val;
-    UInt32Char_t key;
-    int nFans, i;
-    char fanID[8];
+    int len = vsnprintf(&batchBuf[batchLen], sizeof(batchBuf) - batchLen, format, args);
 
-    result = SMCReadKey("FNum", &val);
+    if ( len < 0 || batchLen + len >= sizeof(batchBuf) ) {
+        batchBuf[batchLen] = '\0';
+        return -1;
+    }
+    batchLen += len;
+
+    return 0;
+}
 
-    if (result == kIOReturnSuccess) {
-        nFans = _strtoul((char*)val.bytes, val.dataSize, 10);
 
-        for (i = 0; i < nFans; i++) {
-            sprintf(key, "F%dID", i);
-            result = SMCReadKey(key, &val);
-            if (result != kIOReturnSuccess) { continue; }
 
-            sprintf(key, "F%dAc", i);
-            double cur = getSMCrpm(key);
-            if (cur < 0.f) { continue; }
+// write one line of line protocol into the current batch
+void influxLine(const char* format, ...)
+{
+    va_list args;
 
-            sprintf(key, "F%dMn", i);
-            float min = getSMCrpm(key);
-            if (min < 0.f) { continue; }
+    va_start(args, format);
+    if ( _batchAppend(format, args) == 0 ) { nLines++; }
+    va_end(args);
+}
 
-            sprintf(key, "F%dMx", i);
-            float max = getSMCrpm(key);
-            if (max < 0.f) { continue; }
 
-            float pct = (cur - min ) / ( max - min );
-            pct *= 100.f;
-            if ( pct < 0.f) { pct = 0.f; }
 
-            switch (i) {
-                case 0:
-                    if ( nFans == 1 ) {
-                        strcpy(fanID, "Main");
-                    } else {
-                        strcpy(fanID, "Left"); 
-                    }
-                    break;
-                case 1:
-                    strcpy(fanID, "Right");
-                    break;
-                case '?':
-                    strcpy(fanID, "Other");
-                    break;
-            }
-            if ( cur > 0.0 ) {
-                printf("fan,%skey=F%iAc,sensor=%s rpm=%08.2f,percent=%06.2f %ld\n", hostTag, i, fanID, cur, pct, ens);
-            }
-        }
+// append an escaped name=value pair to the tags written on every line
+int _addTag(const char* name, const char* value)
+{
+    int len = strlen(hostTag);
+
+    if ( len + 2 * (strlen(name) + strlen(value)) + 3 > sizeof(hostTag) ) { return -1; }
+    len += _escapeTag(&hostTag[len], name, sizeof(hostTag) - len);
+    hostTag[len++] = '=';
+    len += _escapeTag(&hostTag[len], value, sizeof(hostTag) - len);
+    strcpy(&hostTag[len], ",");
+
+    return 0;
+}
+
+
+
+// apply -i, -x and -r rules, returns the sensor name to use or NULL if the key is dropped
+const char* _applyRules(char* key, const char* sensor)
+{
+    UInt32 k = _strtoul(key, 4, 16);
+    UInt32 name = strlen(sensor) == 4 ? _strtoul((char*)sensor, 4, 16) : 0;
+    int i;
+
+    // a four character -x is packed like a key, so a four character sensor name such as Main is one compare too
+    for (i = 0; i < nDropKeys; i++) {
+        if ( dropKeys[i] == k || dropKeys[i] == name ) { return NULL; }
+    }
+    for (i = 0; i < nDropPatterns; i++) {
+        if ( fnmatch(dropPatterns[i], key, 0) == 0 || fnmatch(dropPatterns[i], sensor, 0) == 0 ) { return NULL; }
+    }
+    for (i = 0; i < nAllowPatterns; i++) {
+        if ( fnmatch(allowPatterns[i], key, 0) == 0 || fnmatch(allowPatterns[i], sensor, 0) == 0 ) { break; }
+    }
+    if ( nAllowPatterns > 0 && i == nAllowPatterns ) { return NULL; }
+
+    for (i = 0; i < nRenameKeys; i++) {
+        if ( renameKeys[i] == k ) { return renameNames[i]; }
     }
+    return sensor;
 }
 
 
 
-double getSMCtemp(char* key)
+// find or add the state slot for a FourCC key, NULL once the table is full
+SensorState_t* _sensorState(UInt32 key)
 {
-    SMCVal_t val;
-    kern_return_t result;
+    int i;
 
-    result = SMCReadKey(key, &val);
-    if (result == kIOReturnSuccess) {
-        if (val.dataSize > 0) {
-            if (strcmp(val.dataType, "sp78" ) == 0) {
-                int intValue = val.bytes[0] * 256 + (unsigned char)val.bytes[1];
-                return intValue / 256.0;
-            }
-        }
+    for (i = 0; i < nSensorState; i++) {
+        if ( sensorState[i].key == key ) { return &sensorState[i]; }
     }
-    return 0.0;
+    if ( nSensorState == MAX_SENSORS ) { return NULL; }
+
+    memset(&sensorState[nSensorState], 0, sizeof(SensorState_t));
+    sensorState[nSensorState].key = key;
+    return &sensorState[nSensorState++];
 }
 
-void influxSMCtemp( char* key, char* sensor )
+
+
+// decide whether a key that produced a value may be written under the -m cap
+int _admitSeries(char* key)
 {
-    double temperature = getSMCtemp( key );
-    if ( temperature > 0.0 ) {
-        printf("temperature,%skey=%s,sensor=%s temp=%08.2f %ld\n", hostTag, key, sensor, temperature, ens);
+    SensorState_t* st;
+
+    if ( maxSeries == 0 ) { return 1; }
+
+    st = _sensorState(_strtoul(key, 4, 16));
+    if ( st != NULL && st->admitted ) { return 1; }
+    if ( st != NULL && nAdmitted < maxSeries ) {
+        st->admitted = 1;
+        nAdmitted++;
+        return 1;
     }
+
+    nSuppressed++;
+    return 0;
 }
 
 
 
-int main(int argc, char* argv[])
+// keep a written reading for -N, in hundredths, its row number is worked out after the collection
+void _snmpRow(int table, const char* key, const char* sensor, long value)
 {
-    int status;
-    char hostnameFull[265];
+    SnmpRow_t* row;
 
-    long int ns;
-    time_t sec;
-    struct timespec spec;
+    if ( !snmpMode || nSnmpRows[table] == MAX_SENSORS ) { return; }
+    row = &snmpRows[table][nSnmpRows[table]++];
+    strcpy(row->key, key);
+    snprintf(row->sensor, sizeof(row->sensor), "%s", sensor);
+    row->value = value;
+}
 
-    // get hostname
-    status = gethostname( &hostnameFull[0], 256 );
-    if ( status == -1 ) { strcpy(hostnameFull, "NULL"); }
 
-    // strip domain from hostname
-    const char *hostnameFullPtr = hostnameFull;
-    hostnameFullPtr = strchr(hostnameFullPtr, '.');
-    strncpy(hostname,&hostnameFull[0],hostnameFullPtr-hostnameFull);
-    
-    // capatalise first letter of hostname
-    if ( hostname[0]>='a' && hostname[0]<='z' ) {
-        hostname[0]=hostname[0]-32;
-    }
 
-    // get ns epoch
-    clock_gettime(CLOCK_REALTIME, &spec);
-    sec = spec.tv_sec;
-     ns = spec.tv_nsec;
-    ens =  sec * 1000000000 + ns;
+// bucket the 1 minute load average per CPU so baselines are compared like with like
+int _loadLevel(void)
+{
+    double load;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
 
-    // pass options
-    int cpu = 0;
-    int gpu = 0;
-    int wfi = 0;
-    int ssd = 0;
-    int fan = 0;
-    int all = 0;
-    int tag = 0;
+    if ( getloadavg(&load, 1) != 1 || ncpu < 1 ) { return 0; }
+    load /= ncpu;
 
-    int args;
-    while ((args = getopt(argc, argv, "aAcfghwsn?")) != -1) {
-        switch (args) {
-        case 'a':
-            cpu = 1;
-            gpu = 1;
-            fan = 1;
-            wfi = 1;
-            ssd = 1;
-            break;
-        case 'A':
-            all = 1;
-            break;
-        case 'c':
-            cpu = 1;
-            break;
-        case 'f':
-            fan = 1;
-            break;
-        case 'g':
-            gpu = 1;
-            break;
-        case 'w':
-            wfi = 1;
-            break;
-        case 's':
-            ssd = 1;
-            break;
-        case 'n':
-            tag = 1;
-            break;
-        case 'h':
-        case '?':
-            printf("usage: influxdb-smc [aAcfghwsn]\n");
-            printf("  -c  CPU temperature\n");
-            printf("  -g  GPU temperature\n");
-            printf("  -w  WiFi temperature\n");
-            printf("  -s  SSD temperature\n");
-            printf("  -f  fan speeds\n");
-            printf("  -a  CPU, GPU and fans - same as -cgf\n");
-            printf("  -A  all temperature and fan metrics\n");
-            printf("  -n  tag with hostname\n");
-            printf("  -h  this info\n");
-            return -1;
-        }
-    }
+    if ( load < 0.25 ) { return 0; }
+    if ( load < 0.75 ) { return 1; }
+    return 2;
+}
 
-    // tag with hostname -n
-    if ( tag ) { sprintf(hostTag, "host=%s,", hostname); }
-    
-    // default -a
-    if ( !cpu && !gpu && !fan && !wfi && !ssd && !all ) { cpu = gpu = fan = wfi = ssd = 1; }
 
-    // get SMC values and print in line protocol
-    SMCOpen();
 
-    if ( all ) {        
-        influxSMCtemp("TC0P","CPU");
-        influxSMCtemp("TC0p","CPU");
-        influxSMCtemp("TCXr","CPU-Package");
-        influxSMCtemp("TCXR","CPU-Package");
-        influxSMCtemp("TC0E","CPU-Virtual-1");
-        influxSMCtemp("TC0F","CPU-Virtual-2");
-        influxSMCtemp("TC1C","CPU-Core-1");
-        influxSMCtemp("TC2C","CPU-Core-2");
-        influxSMCtemp("TC3C","CPU-Core-3");
-        influxSMCtemp("TC4C","CPU-Core-4");
-        influxSMCtemp("TC5C","CPU-Core-5");
-        influxSMCtemp("TC6C","CPU-Core-6");
-        influxSMCtemp("TC7C","CPU-Core-7");
-        influxSMCtemp("TC8C","CPU-Core-8");
-        influxSMCtemp("TC0c","CPU-Core-1");
-        influxSMCtemp("TC1c","CPU-Core-2");
-        influxSMCtemp("TC2c","CPU-Core-3");
-        influxSMCtemp("TC3c","CPU-Core-4");
-
-        influxSMCtemp("TG0P","GPU");
-        influxSMCtemp("TG1P","GPU-VRAM");
-        influxSMCtemp("TG0D","GPU-Die");
-        influxSMCtemp("TG0p","GPU");
-
-        influxSMCtemp("TH0P","HDD");
-        influxSMCtemp("TH0V","HDD-Drive");
-
-        influxSMCtemp("TH0X","SSD");
-        influxSMCtemp("TH0F","SSD-Filtered");
-        influxSMCtemp("TH0a","SSD-Drive-0-A");
-        influxSMCtemp("TH0b","SSD-Drive-0-B");
-        influxSMCtemp("TH1a","SSD-Drive-1-A");
-        influxSMCtemp("TH1b","SSD-Drive-1-B");
-        influxSMCtemp("TH1c","SSD-Drive-1-C");
-        influxSMCtemp("TH1A","SSD-Drive-1-A");
-        influxSMCtemp("TH1B","SSD-Drive-1-B");
-
-        influxSMCtemp("TL0P","LCD");
-        influxSMCtemp("TL0V","LCD-Front-Right");
-        influxSMCtemp("TL0p","LCD-Front");
-        influxSMCtemp("TL1V","LCD-Front-Center");
-
-        influxSMCtemp("Ts0S","Memory");
-        influxSMCtemp("TM0P","Memory-Bank-1");
-        influxSMCtemp("TM1P","Memory-Bank-2");
-        influxSMCtemp("TM0p","Memory-DIMM-1");
-        influxSMCtemp("TM1p","Memory-DIMM-2");
-        influxSMCtemp("TM2p","Memory-DIMM-3");
-        influxSMCtemp("TM3p","Memory-DIMM-4");
-        influxSMCtemp("TM41","Memory-Virtual");
-
-        influxSMCtemp("Tm0P","Mainboard");
-        influxSMCtemp("Tm1P","Mainboard-Bottom");
-
-        influxSMCtemp("TW0P","WiFi");
-
-        influxSMCtemp("TB1T","Battery-1");
-        influxSMCtemp("TB2T","Battery-2");
-
-        influxSMCtemp("TA0V","Ambient");
-        influxSMCtemp("Ts0P","Palm-Rest-1");
-        influxSMCtemp("Ts1P","Palm-Rest-2");
-        influxSMCtemp("Ts1S","Skin-Top");
-        influxSMCtemp("TA0P","Airflow-1");
-        influxSMCtemp("TA1P","Airflow-2");
-        influxSMCtemp("Th1H","Heatpipe-Left");
-        influxSMCtemp("Th2H","Heatpipe-Right");
-
-        influxSMCtemp("TS0V","Skin");
-        influxSMCtemp("Tb0p","Backlight");
-        influxSMCtemp("Tb0P","BLC");
-
-        influxSMCtemp("TPCD","PCH-Die");
-        influxSMCtemp("TCGC","PECI-GPU");
-        influxSMCtemp("TCXC","PECI-CPU");
-        influxSMCtemp("TCMX","PECI-MAX");
-        influxSMCtemp("TCSA","PECI-SA");
-
-        influxSMCtemp("TCGc","PECI-GPU");
-        influxSMCtemp("TCSc","PECI-SA");
-        influxSMCtemp("TCXc","PECI-CPU");
-
-        influxSMCtemp("Te0T","TBT-Diode");
-        influxSMCtemp("Tm0p","EMC-Diode");
-        influxSMCtemp("Tp0C","Power-Supply");
-        influxSMCtemp("Tp2h","Power-Supply-Heatsink");
-        
-        influxSMCfans();
-    } else {
-        if ( cpu ) { influxSMCtemp("TC0P","CPU"); }
-        if ( gpu ) { influxSMCtemp("TG0P","GPU"); }
-        if ( ssd ) { influxSMCtemp("TH0X","SSD"); }
-        if ( wfi ) { influxSMCtemp("TW0P","WiFi"); }
-        if ( fan ) { influxSMCfans(); }
+// score a reading against its baseline, report sustained deviations, then fold it in unless it is beyond sigma
+double _anomalyScore(char* key, const char* sensor, const char* field, double value)
+{
+    SensorState_t* st = _sensorState(_strtoul(key, 4, 16));
+    Baseline_t* b;
+    double z = 0.0, sd = 0.0, delta;
+
+    if ( st == NULL ) { return 0.0; }
+    b = &st->base[loadLevel];
+
+    if ( b->n >= BASELINE_WARMUP && b->m2 > 0.0 ) {
+        sd = sqrt(b->m2 / (b->n - 1));
+        z = (value - b->mean) / sd;
+    }
+
+    if ( fabs(z) > anomalySigma ) { st->run++; } else { st->run = 0; }
+    if ( st->run >= anomalyRun ) {
+        influxLine("anomaly,%skey=%s,sensor=%s,field=%s value=%.2f,mean=%.2f,sd=%.2f,z=%.2f,run=%di %ld\n",
+            hostTag, key, sensor, field, value, b->mean, sd, z, st->run, ens);
+    }
+
+    // outliers stay out of the baseline, or a slow failure would be absorbed before -K runs are reached
+    if ( fabs(z) > anomalySigma ) { return z; }
+
+    // Welford update, the window cap decays old samples so the baseline follows slow drift
+    if ( b->n == BASELINE_WINDOW ) {
+        b->m2 -= b->m2 / b->n;
+    } else {
+        b->n++;
+    }
+    delta = value - b->mean;
+    b->mean += delta / b->n;
+    b->m2 += delta * (value - b->mean);
+
+    return z;
+}
+
+
+
+// update the sensor's AR(2) model with a new reading and predict the next one, constant cost per sample
+int _forecast(char* key, double value, double* forecast, double* error)
+{
+    SensorState_t* st = _sensorState(_strtoul(key, 4, 16));
+    Forecast_t* f;
+    double phi[RLS_ORDER], Pphi[RLS_ORDER], gain[RLS_ORDER], denom, e, trace;
+    int i, j, valid;
+
+    if ( st == NULL ) { return -1; }
+    f = &st->rls;
+
+    // start from persistence, y[t] = y[t-1], with a large covariance so the fit moves quickly
+    if ( f->n == 0 ) {
+        memset(f, 0, sizeof(Forecast_t));
+        f->theta[0] = 1.0;
+        for (i = 0; i < RLS_ORDER; i++) { f->P[i][i] = 1000.0; }
+    }
+
+    valid = f->n >= 3;
+    *error = valid ? value - f->forecast : 0.0;
+
+    if ( f->n >= 2 ) {
+        phi[0] = f->y1;
+        phi[1] = f->y2;
+        phi[2] = 1.0;
+
+        denom = RLS_FORGET;
+        for (i = 0; i < RLS_ORDER; i++) {
+            Pphi[i] = 0.0;
+            for (j = 0; j < RLS_ORDER; j++) { Pphi[i] += f->P[i][j] * phi[j]; }
+            denom += phi[i] * Pphi[i];
+        }
+
+        e = value;
+        for (i = 0; i < RLS_ORDER; i++) {
+            gain[i] = Pphi[i] / denom;
+            e -= f->theta[i] * phi[i];
+        }
+        // the symmetric form of the update keeps P symmetric to the last bit
+        for (i = 0, trace = 0.0; i < RLS_ORDER; i++) {
+            f->theta[i] += gain[i] * e;
+            for (j = 0; j < RLS_ORDER; j++) {
+                f->P[i][j] = ( f->P[i][j] - Pphi[i] * Pphi[j] / denom ) / RLS_FORGET;
+            }
+            trace += f->P[i][i];
+        }
+
+        // readings near 50 next to a bias of 1 leave P badly conditioned: if rounding costs it
+        // positive definiteness, or forgetting lets it grow without bound, restart the covariance
+        if ( trace > RLS_MAX_TRACE || f->P[0][0] <= 0.0 || f->P[1][1] <= 0.0 || f->P[2][2] <= 0.0 ) {
+            memset(f->P, 0, sizeof(f->P));
+            for (i = 0; i < RLS_ORDER; i++) { f->P[i][i] = RLS_MAX_TRACE / RLS_ORDER; }
+        }
+    }
+
+    f->y2 = f->n >= 1 ? f->y1 : value;
+    f->y1 = value;
+    if ( f->n < 3 ) { f->n++; }
+
+    f->forecast = f->theta[0] * f->y1 + f->theta[1] * f->y2 + f->theta[2];
+    *forecast = f->forecast;
+
+    return valid ? 0 : 1;
+}
+
+
+
+// fold a measured read latency into the key's running cost
+void _readCost(char* key, long us)
+{
+    SensorState_t* st = _sensorState(_strtoul(key, 4, 16));
+
+    if ( st == NULL ) { return; }
+    st->cost = st->cost == 0.0 ? us : st->cost + COST_ALPHA * ( us - st->cost );
+    st->age = 0;
+}
+
+
+
+// open and lock the state file, then read what the previous run left behind
+int loadState(const char* path)
+{
+    char buf[1024];
+    FILE* fp;
+
+    stateFd = open(path, O_RDWR | O_CREAT, 0644);
+    if ( stateFd == -1 ) { return -1; }
+
+    // overlapping runs would otherwise hand out the same sequence number
+    if ( flock(stateFd, LOCK_EX) != 0 ) { return -1; }
+
+    fp = fdopen(dup(stateFd), "r");
+    if ( fp == NULL ) { return -1; }
+    while ( fgets(buf, sizeof(buf), fp) != NULL ) {
+        UInt32 key;
+        int level, run;
+        Baseline_t b;
+
+        if ( sscanf(buf, "seq %lu", &batchSeq) == 1 ) { continue; }
+        if ( sscanf(buf, "base %x %d %ld %lf %lf", &key, &level, &b.n, &b.mean, &b.m2) == 5 ) {
+            SensorState_t* st = _sensorState(key);
+            if ( st != NULL && level >= 0 && level < LOAD_LEVELS ) { st->base[level] = b; }
+        } else if ( sscanf(buf, "run %x %d", &key, &run) == 2 ) {
+            SensorState_t* st = _sensorState(key);
+            if ( st != NULL ) { st->run = run; }
+        } else if ( sscanf(buf, "energy %x", &key) == 1 ) {
+            SensorState_t* st = _sensorState(key);
+            if ( st != NULL ) {
+                sscanf(buf, "energy %*x %ld %lf %lf %lf", &st->lastTime, &st->lastValue, &st->energy, &st->missed);
+            }
+        } else if ( sscanf(buf, "rls %x", &key) == 1 ) {
+            SensorState_t* st = _sensorState(key);
+            Forecast_t* f = st != NULL ? &st->rls : NULL;
+            if ( f != NULL && sscanf(buf, "rls %*x %d %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf",
+                    &f->n, &f->y1, &f->y2, &f->forecast, &f->theta[0], &f->theta[1], &f->theta[2],
+                    &f->P[0][0], &f->P[0][1], &f->P[0][2], &f->P[1][0], &f->P[1][1], &f->P[1][2],
+                    &f->P[2][0], &f->P[2][1], &f->P[2][2]) != 16 ) {
+                f->n = 0;
+            }
+        } else if ( strncmp(buf, "episode ", 8) == 0 && nEpisodes < MAX_GROUPS ) {
+            Episode_t* ep = &episodes[nEpisodes];
+            memset(ep, 0, sizeof(Episode_t));
+            if ( sscanf(buf, "episode %15s %lf %d %ld %ld %lf %lf %lf %lf %lf", ep->group, &ep->baseline, &ep->active,
+                    &ep->start, &ep->last, &ep->peak, &ep->integral, &ep->above[0], &ep->above[1], &ep->above[2]) == 10 ) {
+                nEpisodes++;
+            }
+        } else if ( sscanf(buf, "series %x", &key) == 1 ) {
+            SensorState_t* st = _sensorState(key);
+            if ( st != NULL && !st->admitted ) {
+                st->admitted = 1;
+                nAdmitted++;
+            }
+        } else if ( sscanf(buf, "cost %x", &key) == 1 ) {
+            SensorState_t* st = _sensorState(key);
+            if ( st != NULL ) { sscanf(buf, "cost %*x %lf %d", &st->cost, &st->age); }
+        }
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+
+
+// append to the state buffer, fails rather than truncating a record
+int _stateAppend(const char* format, ...)
+{
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(&stateBuf[stateLen], sizeof(stateBuf) - stateLen, format, args);
+    va_end(args);
+
+    if ( len < 0 || stateLen + len >= sizeof(stateBuf) ) { return -1; }
+    stateLen += len;
+
+    return 0;
+}
+
+
+
+// rewrite the state file in place from a static buffer, the lock is released when the process exits
+int saveState(void)
+{
+    int i, j, status = 0;
+
+    if ( stateFd == -1 ) { return 0; }
+
+    stateLen = 0;
+    status |= _stateAppend("seq %lu\n", batchSeq);
+    for (i = 0; i < nSensorState; i++) {
+        SensorState_t* st = &sensorState[i];
+        for (j = 0; j < LOAD_LEVELS; j++) {
+            if ( st->base[j].n == 0 ) { continue; }
+            status |= _stateAppend("base %08x %d %ld %.17g %.17g\n", st->key, j, st->base[j].n, st->base[j].mean, st->base[j].m2);
+        }
+        status |= _stateAppend("run %08x %d\n", st->key, st->run);
+        if ( st->lastTime != 0 ) {
+            status |= _stateAppend("energy %08x %ld %.17g %.17g %.17g\n", st->key, st->lastTime, st->lastValue, st->energy, st->missed);
+        }
+        if ( st->rls.n != 0 ) {
+            Forecast_t* f = &st->rls;
+            status |= _stateAppend("rls %08x %d %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g\n",
+                st->key, f->n, f->y1, f->y2, f->forecast, f->theta[0], f->theta[1], f->theta[2],
+                f->P[0][0], f->P[0][1], f->P[0][2], f->P[1][0], f->P[1][1], f->P[1][2],
+                f->P[2][0], f->P[2][1], f->P[2][2]);
+        }
+        if ( st->admitted ) {
+            status |= _stateAppend("series %08x\n", st->key);
+        }
+        if ( st->cost != 0.0 || st->age != 0 ) {
+            status |= _stateAppend("cost %08x %.17g %d\n", st->key, st->cost, st->age);
+        }
+    }
+    for (i = 0; i < nEpisodes; i++) {
+        Episode_t* ep = &episodes[i];
+        status |= _stateAppend("episode %s %.17g %d %ld %ld %.17g %.17g %.17g %.17g %.17g\n", ep->group, ep->baseline, ep->active,
+            ep->start, ep->last, ep->peak, ep->integral, ep->above[0], ep->above[1], ep->above[2]);
+    }
+    if ( status != 0 ) { return -1; }
+
+    if ( ftruncate(stateFd, 0) != 0 ) { return -1; }
+    if ( pwrite(stateFd, stateBuf, stateLen, 0) != stateLen ) { return -1; }
+
+    return 0;
+}
+
+
+
+// the collector line describes the batch, so it is not counted in it
+void _collectorLine(const char* format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    _batchAppend(format, args);
+    va_end(args);
+}
+
+
+
+// one line per batch describing the batch itself
+void influxBatch(void)
+{
+    int len = strlen(hostTag);
+    struct timespec spec;
+    struct rusage usage;
+
+    // peak resident set size, in bytes on macOS, and CPU time and wakeups so far, cumulative with -I
+    getrusage(RUSAGE_SELF, &usage);
+
+    // send time, taken after the SMC reads, for clock offset estimation at the receiver
+    clock_gettime(CLOCK_REALTIME, &spec);
+
+    _collectorLine("collector%s%.*s seq=%lui,lines=%di,skipped=%di,suppressed=%di,dropped=%ldi,maxrss=%ldi,"
+        "cpu=%ldi,wakeups=%ldi,csw=%ldi,readus=%ldi,formatus=%ldi,sinkus=%ldi,sent=%ldi %ld\n",
+        len ? "," : "", len ? len - 1 : 0, hostTag, batchSeq, nLines, nSkipped, nSuppressed, nDropped, (long)usage.ru_maxrss,
+        (long)( usage.ru_utime.tv_sec + usage.ru_stime.tv_sec ) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec,
+        nWakeups, (long)( usage.ru_nvcsw + usage.ru_nivcsw ), usRead, usFormat, usSink,
+        spec.tv_sec * 1000000000 + spec.tv_nsec, ens);
+}
+
+
+// readings are carried in hundredths, exact for fpe2, and only become floating point for the statistics
+long getSMCrpm(char* key)
+{
+    SMCVal_t val;
+    kern_return_t result;
+    float fval;
+
+    result = SMCReadKey(key, &val);
+    if (result == kIOReturnSuccess) {
+        if (val.dataSize > 0) {
+            if (strcmp(val.dataType, "flt " ) == 0) {
+                memcpy(&fval,val.bytes,sizeof(float));
+                // exact in double, and rounding half to even under the default mode is what printf did
+                return llrint(fval * 100.0);
+            } else if ( strcmp(val.dataType, "fpe2" ) == 0 && val.dataSize == 2 ) {
+                return ( (unsigned char)val.bytes[0] << 8 | (unsigned char)val.bytes[1] ) * 25;
+            }
+        }
+    }
+    return -1;
+}
+
+
+
+// hundredths as printf's %0<width>.2f would write them, without a round trip through floating point
+char* _centi(char* dst, long value, int width)
+{
+    sprintf(dst, "%s%0*ld.%02ld", value < 0 ? "-" : "", width - 3 - ( value < 0 ), labs(value) / 100, labs(value) % 100);
+    return dst;
+}
+
+
+
+// spXY and fpXY fixed point, -1 for any other type or size so callers skip the key rather than write a zero
+double _strtofixed(SMCVal_t* val)
+{
+    int frac, raw;
+
+    if ( val->dataSize != 2 ) { return -1.0; }
+    if ( strncmp(val->dataType, "sp", 2) != 0 && strncmp(val->dataType, "fp", 2) != 0 ) { return -1.0; }
+
+    frac = val->dataType[3];
+    frac = frac >= 'a' ? frac - 'a' + 10 : frac - '0';
+    if ( frac < 0 || frac > 15 ) { return -1.0; }
+
+    raw = (unsigned char)val->bytes[0] << 8 | (unsigned char)val->bytes[1];
+    if ( val->dataType[0] == 's' && raw & 0x8000 ) { raw -= 0x10000; }
+
+    return raw / (double)(1 << frac);
+}
+
+
+
+// decode the SMC integer types, ui8/ui16/ui32 and si8/si16/si32, all big endian
+int _strtoint(SMCVal_t* val, long* out)
+{
+    unsigned long raw = 0;
+    int i, bits;
+
+    if ( strcmp(val->dataType, "ui8 ") == 0 || strcmp(val->dataType, "si8 ") == 0 ) {
+        bits = 8;
+    } else if ( strcmp(val->dataType, "ui16") == 0 || strcmp(val->dataType, "si16") == 0 ) {
+        bits = 16;
+    } else if ( strcmp(val->dataType, "ui32") == 0 || strcmp(val->dataType, "si32") == 0 ) {
+        bits = 32;
+    } else {
+        return -1;
+    }
+    if ( val->dataSize != bits / 8 ) { return -1; }
+
+    for (i = 0; i < bits / 8; i++) {
+        raw = raw << 8 | (unsigned char)val->bytes[i];
+    }
+    if ( val->dataType[0] == 's' && raw >> (bits - 1) ) {
+        *out = (long)raw - (1L << bits);
+    } else {
+        *out = (long)raw;
+    }
+
+    return 0;
+}
+
+
+
+int getSMCint(char* key, long* out)
+{
+    SMCVal_t val;
+
+    if ( SMCReadKey(key, &val) != kIOReturnSuccess || val.dataSize == 0 ) { return -1; }
+    return _strtoint(&val, out);
+}
+
+
+
+// battery gauge keys, one set per battery
+void influxSMCbattery()
+{
+    static const struct {
+        const char* key;
+        const char* field;
+    } gauge[] = {
+        { "B%dAV", "voltage" },
+        { "B%dAC", "current" },
+        { "B%dFC", "capacity" },
+        { "B%dRM", "remaining" },
+        { "B%dCT", "cycles" },
+    };
+    UInt32Char_t key;
+    char fields[256];
+    long nBatteries, value, capacity, remaining;
+    int i, j, len;
+
+    if ( getSMCint("BNum", &nBatteries) != 0 ) { return; }
+
+    for (i = 0; i < nBatteries && i < 10; i++) {
+        len = 0;
+        capacity = remaining = -1;
+
+        for (j = 0; j < sizeof(gauge) / sizeof(gauge[0]); j++) {
+            sprintf(key, gauge[j].key, i);
+            if ( getSMCint(key, &value) != 0 ) { continue; }
+            len += sprintf(&fields[len], "%s%s=%ldi", len ? "," : "", gauge[j].field, value);
+            if ( j == 2 ) { capacity = value; }
+            if ( j == 3 ) { remaining = value; }
+        }
+        if ( capacity > 0 && remaining >= 0 ) {
+            len += sprintf(&fields[len], "%scharge=%.1f", len ? "," : "", 100.0 * remaining / capacity);
+        }
+
+        if ( len > 0 ) {
+            influxLine("battery,%sbattery=%d %s %ld\n", hostTag, i, fields, ens);
+        }
+    }
+}
+
+
+
+double getSMCpower(char* key)
+{
+    SMCVal_t val;
+    kern_return_t result;
+    float fval;
+
+    result = SMCReadKey(key, &val);
+    if (result == kIOReturnSuccess && val.dataSize > 0) {
+        if (strcmp(val.dataType, "flt ") == 0) {
+            memcpy(&fval, val.bytes, sizeof(float));
+            return fval;
+        }
+        return _strtofixed(&val);
+    }
+    return -1.0;
+}
+
+
+
+// integrate power since the previous run with the trapezoidal rule
+void influxSMCpower( char* key, char* name )
+{
+    const char* sensor = _applyRules( key, name );
+    SensorState_t* st;
+    double watts, joules = 0.0, dt;
+
+    if ( sensor == NULL ) { return; }
+
+    watts = getSMCpower( key );
+    if ( watts < 0.0 || !_admitSeries( key ) ) { return; }
+
+    st = _sensorState( _strtoul(key, 4, 16) );
+    if ( st == NULL ) { return; }
+
+    dt = ( ens - st->lastTime ) / 1e9;
+    if ( st->lastTime != 0 ) {
+        if ( dt > 0.0 && dt <= ENERGY_MAX_GAP ) {
+            joules = ( st->lastValue + watts ) / 2.0 * dt;
+            st->energy += joules;
+        } else if ( dt > 0.0 ) {
+            st->missed += dt;
+        }
+    }
+    st->lastTime = ens;
+    st->lastValue = watts;
+
+    influxLine("power,%skey=%s,sensor=%s watts=%.2f,joules=%.1f,total=%.1f,missed=%.0f %ld\n",
+        hostTag, key, sensor, watts, joules, st->energy, st->missed, ens);
+}
+
+
+
+void influxSMCfans()
+{
+    kern_return_t result;
+    SMCVal_t val;
+    UInt32Char_t key, fanKey;
+    int nFans, i;
+    char fanID[8];
+
+    result = SMCReadKey("FNum", &val);
+
+    if (result == kIOReturnSuccess) {
+        nFans = _strtoul((char*)val.bytes, val.dataSize, 10);
+
+        // one digit in the key, as for batteries
+        for (i = 0; i < nFans && i < 10; i++) {
+            switch (i) {
+                case 0:
+                    if ( nFans == 1 ) {
+                        strcpy(fanID, "Main");
+                    } else {
+                        strcpy(fanID, "Left"); 
+                    }
+                    break;
+                case 1:
+                    strcpy(fanID, "Right");
+                    break;
+                default:
+                    strcpy(fanID, "Other");
+                    break;
+            }
+
+            // rules first, a dropped fan costs no SMC reads
+            snprintf(fanKey, sizeof(fanKey), "F%dAc", i);
+            const char* sensor = _applyRules(fanKey, fanID);
+            if ( sensor == NULL ) { continue; }
+
+            snprintf(key, sizeof(key), "F%dID", i);
+            result = SMCReadKey(key, &val);
+            if (result != kIOReturnSuccess) { continue; }
+
+            long cur = getSMCrpm(fanKey);
+            if (cur < 0) { continue; }
+
+            snprintf(key, sizeof(key), "F%dMn", i);
+            long min = getSMCrpm(key);
+            if (min < 0) { continue; }
+
+            snprintf(key, sizeof(key), "F%dMx", i);
+            long max = getSMCrpm(key);
+            if (max < 0) { continue; }
+
+            // in hundredths of a percent, rounded to the nearest
+            long pct = 0;
+            if ( max > min ) { pct = ( ( cur - min ) * 20000 + ( max - min ) ) / ( 2 * ( max - min ) ); }
+            if ( pct < 0 ) { pct = 0; }
+
+            if ( cur > 0 && _admitSeries(fanKey) ) {
+                char score[32] = "";
+                char rpm[24], percent[24];
+                if ( anomalySigma > 0.0 ) { sprintf(score, ",z=%.2f", _anomalyScore(fanKey, sensor, "rpm", cur / 100.0)); }
+                influxLine("fan,%skey=%s,sensor=%s rpm=%s,percent=%s%s %ld\n", hostTag, fanKey, sensor,
+                    _centi(rpm, cur, 8), _centi(percent, pct, 6), score, ens);
+                _snmpRow(1, fanKey, sensor, cur);
+            }
+        }
+    }
+}
+
+
+
+// hundredths of a degree, sp78 rounded half to even so the text is what printf wrote from a double
+long getSMCtemp(char* key)
+{
+    SMCVal_t val;
+    kern_return_t result;
+
+    result = SMCReadKey(key, &val);
+    if (result == kIOReturnSuccess) {
+        if (val.dataSize > 0) {
+            if (strcmp(val.dataType, "sp78" ) == 0) {
+                long intValue = val.bytes[0] * 256 + (unsigned char)val.bytes[1];
+                long scaled = labs(intValue) * 100;
+                long centi = scaled / 256;
+                if ( scaled % 256 > 128 || ( scaled % 256 == 128 && centi % 2 ) ) { centi++; }
+                return intValue < 0 ? -centi : centi;
+            }
+        }
+    }
+    return 0;
+}
+
+// note a reading against its group, the group follows its hottest sensor
+void _episodeSample(const char* sensor, double value)
+{
+    char group[16];
+    int i;
+
+    for (i = 0; sensor[i] && sensor[i] != '-' && i < sizeof(group) - 1; i++) { group[i] = sensor[i]; }
+    group[i] = '\0';
+
+    for (i = 0; i < nEpisodes; i++) {
+        if ( strcmp(episodes[i].group, group) == 0 ) { break; }
+    }
+    if ( i == nEpisodes ) {
+        if ( nEpisodes == MAX_GROUPS ) { return; }
+        memset(&episodes[nEpisodes], 0, sizeof(Episode_t));
+        strcpy(episodes[nEpisodes++].group, group);
+    }
+
+    if ( !episodes[i].seen || value > episodes[i].current ) { episodes[i].current = value; }
+    episodes[i].seen = 1;
+}
+
+
+
+// advance each group's segmenter and write one line per finished episode
+void influxEpisodes(void)
+{
+    Episode_t* ep;
+    double dt;
+    int i, j, ended;
+
+    for (i = 0; i < nEpisodes; i++) {
+        ep = &episodes[i];
+        if ( !ep->seen ) { continue; }
+        ep->seen = 0;
+
+        if ( ep->baseline == 0.0 ) { ep->baseline = ep->current; }
+        dt = ( ens - ep->last ) / 1e9;
+
+        if ( ep->active ) {
+            // a long gap ends the episode at the last reading rather than guessing what happened
+            ended = dt <= 0.0 || dt > ENERGY_MAX_GAP || ep->current < ep->baseline + episodeRise / 2.0;
+            if ( !ended ) {
+                ep->integral += ( ep->current - ep->baseline ) * dt;
+                for (j = 0; j < EPISODE_LEVELS; j++) {
+                    if ( ep->current >= episodeLevel[j] ) { ep->above[j] += dt; }
+                }
+                if ( ep->current > ep->peak ) { ep->peak = ep->current; }
+                ep->last = ens;
+                continue;
+            }
+
+            influxLine("episode,%sgroup=%s start=%ldi,end=%ldi,duration=%.0f,baseline=%.2f,peak=%.2f,"
+                "above%.0f=%.0f,above%.0f=%.0f,above%.0f=%.0f,integral=%.1f %ld\n",
+                hostTag, ep->group, ep->start, ep->last, ( ep->last - ep->start ) / 1e9, ep->baseline, ep->peak,
+                episodeLevel[0], ep->above[0], episodeLevel[1], ep->above[1], episodeLevel[2], ep->above[2],
+                ep->integral, ep->start);
+            ep->active = 0;
+        }
+
+        if ( ep->current > ep->baseline + episodeRise ) {
+            ep->active = 1;
+            ep->start = ep->last = ens;
+            ep->peak = ep->current;
+            ep->integral = 0.0;
+            memset(ep->above, 0, sizeof(ep->above));
+        } else {
+            // the baseline only follows quiet periods
+            ep->baseline += EPISODE_ALPHA * ( ep->current - ep->baseline );
+            ep->last = ens;
+        }
+    }
+}
+
+
+
+void influxSMCtemp( char* key, char* name )
+{
+    const char* sensor = _applyRules( key, name );
+    if ( sensor == NULL ) { return; }
+
+    long started = _monotonicUs();
+    long temperature = getSMCtemp( key );
+    if ( stateFd != -1 ) { _readCost( key, _monotonicUs() - started ); }
+
+    if ( temperature > 0 && _admitSeries( key ) ) {
+        char score[32] = "";
+        char predict[64] = "";
+        char temp[24];
+        double forecast, error, degrees = temperature / 100.0;
+        if ( anomalySigma > 0.0 ) { sprintf(score, ",z=%.2f", _anomalyScore(key, sensor, "temp", degrees)); }
+        if ( forecasting ) {
+            int status = _forecast(key, degrees, &forecast, &error);
+            if ( status == 0 ) {
+                sprintf(predict, ",forecast=%.2f,ferr=%.2f", forecast, error);
+            } else if ( status == 1 ) {
+                sprintf(predict, ",forecast=%.2f", forecast);
+            }
+        }
+        influxLine("temperature,%skey=%s,sensor=%s temp=%s%s%s %ld\n", hostTag, key, sensor, _centi(temp, temperature, 8),
+            score, predict, ens);
+        _snmpRow(0, key, sensor, temperature);
+        if ( episodeRise > 0.0 ) { _episodeSample(sensor, degrees); }
+    }
+}
+
+
+
+// sensors read by -A, priority 1 sensors are always read when -B limits the time spent
+typedef struct {
+    char* key;
+    char* sensor;
+    int priority;
+} SensorDef_t;
+
+SensorDef_t allTemps[] = {
+    { "TC0P", "CPU",                     1 },
+    { "TC0p", "CPU",                     0 },
+    { "TCXr", "CPU-Package",             0 },
+    { "TCXR", "CPU-Package",             0 },
+    { "TC0E", "CPU-Virtual-1",           0 },
+    { "TC0F", "CPU-Virtual-2",           0 },
+    { "TC1C", "CPU-Core-1",              0 },
+    { "TC2C", "CPU-Core-2",              0 },
+    { "TC3C", "CPU-Core-3",              0 },
+    { "TC4C", "CPU-Core-4",              0 },
+    { "TC5C", "CPU-Core-5",              0 },
+    { "TC6C", "CPU-Core-6",              0 },
+    { "TC7C", "CPU-Core-7",              0 },
+    { "TC8C", "CPU-Core-8",              0 },
+    { "TC0c", "CPU-Core-1",              0 },
+    { "TC1c", "CPU-Core-2",              0 },
+    { "TC2c", "CPU-Core-3",              0 },
+    { "TC3c", "CPU-Core-4",              0 },
+
+    { "TG0P", "GPU",                     1 },
+    { "TG1P", "GPU-VRAM",                0 },
+    { "TG0D", "GPU-Die",                 0 },
+    { "TG0p", "GPU",                     0 },
+
+    { "TH0P", "HDD",                     0 },
+    { "TH0V", "HDD-Drive",               0 },
+
+    { "TH0X", "SSD",                     1 },
+    { "TH0F", "SSD-Filtered",            0 },
+    { "TH0a", "SSD-Drive-0-A",           0 },
+    { "TH0b", "SSD-Drive-0-B",           0 },
+    { "TH1a", "SSD-Drive-1-A",           0 },
+    { "TH1b", "SSD-Drive-1-B",           0 },
+    { "TH1c", "SSD-Drive-1-C",           0 },
+    { "TH1A", "SSD-Drive-1-A",           0 },
+    { "TH1B", "SSD-Drive-1-B",           0 },
+
+    { "TL0P", "LCD",                     0 },
+    { "TL0V", "LCD-Front-Right",         0 },
+    { "TL0p", "LCD-Front",               0 },
+    { "TL1V", "LCD-Front-Center",        0 },
+
+    { "Ts0S", "Memory",                  0 },
+    { "TM0P", "Memory-Bank-1",           0 },
+    { "TM1P", "Memory-Bank-2",           0 },
+    { "TM0p", "Memory-DIMM-1",           0 },
+    { "TM1p", "Memory-DIMM-2",           0 },
+    { "TM2p", "Memory-DIMM-3",           0 },
+    { "TM3p", "Memory-DIMM-4",           0 },
+    { "TM41", "Memory-Virtual",          0 },
+
+    { "Tm0P", "Mainboard",               0 },
+    { "Tm1P", "Mainboard-Bottom",        0 },
+
+    { "TW0P", "WiFi",                    1 },
+
+    { "TB1T", "Battery-1",               0 },
+    { "TB2T", "Battery-2",               0 },
+
+    { "TA0V", "Ambient",                 0 },
+    { "Ts0P", "Palm-Rest-1",             0 },
+    { "Ts1P", "Palm-Rest-2",             0 },
+    { "Ts1S", "Skin-Top",                0 },
+    { "TA0P", "Airflow-1",               0 },
+    { "TA1P", "Airflow-2",               0 },
+    { "Th1H", "Heatpipe-Left",           0 },
+    { "Th2H", "Heatpipe-Right",          0 },
+
+    { "TS0V", "Skin",                    0 },
+    { "Tb0p", "Backlight",               0 },
+    { "Tb0P", "BLC",                     0 },
+
+    { "TPCD", "PCH-Die",                 0 },
+    { "TCGC", "PECI-GPU",                0 },
+    { "TCXC", "PECI-CPU",                0 },
+    { "TCMX", "PECI-MAX",                0 },
+    { "TCSA", "PECI-SA",                 0 },
+
+    { "TCGc", "PECI-GPU",                0 },
+    { "TCSc", "PECI-SA",                 0 },
+    { "TCXc", "PECI-CPU",                0 },
+
+    { "Te0T", "TBT-Diode",               0 },
+    { "Tm0p", "EMC-Diode",               0 },
+    { "Tp0C", "Power-Supply",            0 },
+    { "Tp2h", "Power-Supply-Heatsink",   0 },
+};
+
+// read a list of temperature sensors, within the -B budget when one is set
+void influxSMCtemps(SensorDef_t* defs, int n)
+{
+    char done[MAX_SENSORS];
+    SensorState_t* st;
+    double score, bestScore = 0.0;
+    int i, best, forced = 0;
+
+    if ( readBudget <= 0.0 ) {
+        for (i = 0; i < n; i++) { influxSMCtemp(defs[i].key, defs[i].sensor); }
+        return;
+    }
+    if ( n > MAX_SENSORS ) { n = MAX_SENSORS; }
+
+    // keys ruled out by -x or -i take no part in scheduling, they are never read so they have no cost or age
+    for (i = 0; i < n; i++) {
+        if ( _applyRules(defs[i].key, defs[i].sensor) == NULL ) {
+            done[i] = 1;
+            continue;
+        }
+        done[i] = defs[i].priority;
+        if ( done[i] ) { influxSMCtemp(defs[i].key, defs[i].sensor); }
+    }
+
+    // then the rest, longest unread per microsecond of cost first, until the budget is spent
+    for (;;) {
+        for (best = -1, i = 0; i < n; i++) {
+            if ( done[i] ) { continue; }
+            st = _sensorState(_strtoul(defs[i].key, 4, 16));
+            score = st == NULL ? 1e9 : ( st->age + 1 ) / ( st->cost + 1.0 );
+            if ( best < 0 || score > bestScore ) {
+                best = i;
+                bestScore = score;
+            }
+        }
+        if ( best < 0 ) { break; }
+        done[best] = 1;
+
+        st = _sensorState(_strtoul(defs[best].key, 4, 16));
+        if ( st == NULL || _monotonicUs() - collectStart + st->cost <= readBudget ) {
+            influxSMCtemp(defs[best].key, defs[best].sensor);
+        } else if ( !forced && st->age >= SCHED_MAX_AGE ) {
+            // at most one key a run goes over budget, so every key is read eventually
+            forced = 1;
+            influxSMCtemp(defs[best].key, defs[best].sensor);
+        } else {
+            st->age++;
+            nSkipped++;
+        }
+    }
+}
+
+
+
+// find the first unescaped c in a line protocol string
+char* _unescapedChr(char* str, char c)
+{
+    for ( ; *str; str++) {
+        if ( *str == '\\' && str[1] ) { str++; continue; }
+        if ( *str == c ) { return str; }
+    }
+    return NULL;
+}
+
+
+
+// pull the key and sensor tags, the first field and the timestamp out of a line this tool wrote
+int _parseLine(char* line, UInt32* key, char* sensor, int sensorSize, double* value, long* ts)
+{
+    char *fields, *stamp, *tag, *next, *end;
+    int i;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    *key = 0;
+    sensor[0] = '\0';
+
+    fields = _unescapedChr(line, ' ');
+    if ( fields == NULL ) { return -1; }
+    *fields++ = '\0';
+    stamp = _unescapedChr(fields, ' ');
+    if ( stamp == NULL ) { return -1; }
+    *stamp++ = '\0';
+
+    *ts = strtol(stamp, &end, 10);
+    if ( end == stamp ) { return -1; }
+
+    // tags follow the measurement, the sensor value is unescaped for display
+    for (tag = _unescapedChr(line, ','); tag != NULL; tag = next) {
+        *tag++ = '\0';
+        next = _unescapedChr(tag, ',');
+        if ( next != NULL ) { *next = '\0'; }
+        if ( strncmp(tag, "key=", 4) == 0 && strlen(tag) == 8 ) {
+            *key = _strtoul(&tag[4], 4, 16);
+        } else if ( strncmp(tag, "sensor=", 7) == 0 ) {
+            for (tag += 7, i = 0; *tag && i < sensorSize - 1; tag++) {
+                if ( *tag == '\\' && tag[1] ) { tag++; }
+                sensor[i++] = *tag;
+            }
+            sensor[i] = '\0';
+        }
+    }
+    if ( *key == 0 ) { return -1; }
+
+    fields = _unescapedChr(fields, '=');
+    if ( fields == NULL ) { return -1; }
+    *value = strtod(fields + 1, &end);
+    if ( end == fields + 1 ) { return -1; }
+
+    return 0;
+}
+
+
+
+// online pairwise co-moments for -C, indexed by slot in sensorState
+typedef struct {
+    long n;
+    double meanX;
+    double meanY;
+    double cXX;
+    double cYY;
+    double cXY;
+} CoMoment_t;
+
+CoMoment_t coMoment[MAX_SENSORS][MAX_SENSORS];
+char traceName[MAX_SENSORS][32];
+double traceRow[MAX_SENSORS];
+int traceSeen[MAX_SENSORS];
+double corrWork[MAX_SENSORS][2 * MAX_SENSORS];
+
+// a recorded trace for -C and -R, held in memory so it can be put in time order
+#define SAMPLE_TEMPERATURE 0
+#define SAMPLE_FAN 1
+#define SAMPLE_OTHER 2
+
+typedef struct {
+    UInt32 key;
+    int slot;
+    int kind;
+    double value;
+    long ts;
+    long seq;
+} TraceSample_t;
+
+TraceSample_t* traceSamples = NULL;
+long nTraceSamples = 0;
+
+
+
+// by timestamp, then input order, so the sort is stable
+int _traceCompare(const void* a, const void* b)
+{
+    const TraceSample_t* x = a;
+    const TraceSample_t* y = b;
+
+    if ( x->ts != y->ts ) { return x->ts < y->ts ? -1 : 1; }
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+
+
+// read this tool's line protocol from stdin and sort it by time, exports are usually ordered by series instead
+int loadTrace(void)
+{
+    char line[1024], sensor[32];
+    UInt32 key;
+    double value;
+    long ts;
+    size_t size = 0;
+    TraceSample_t* grown;
+    SensorState_t* st;
+    int kind;
+
+    while ( fgets(line, sizeof(line), stdin) != NULL ) {
+        // anomaly lines repeat a reading under its key, they are derived rather than recorded
+        if ( strncmp(line, "anomaly,", 8) == 0 ) { continue; }
+        kind = strncmp(line, "temperature,", 12) == 0 ? SAMPLE_TEMPERATURE :
+               strncmp(line, "fan,", 4) == 0 ? SAMPLE_FAN : SAMPLE_OTHER;
+        if ( _parseLine(line, &key, sensor, sizeof(sensor), &value, &ts) != 0 ) { continue; }
+        st = _sensorState(key);
+        if ( st == NULL ) { continue; }
+        if ( nTraceSamples == size ) {
+            size = size ? size * 2 : 4096;
+            grown = realloc(traceSamples, size * sizeof(TraceSample_t));
+            if ( grown == NULL ) {
+                fprintf(stderr, "Error: trace does not fit in memory\n");
+                return -1;
+            }
+            traceSamples = grown;
+        }
+        if ( traceName[st - sensorState][0] == '\0' ) { strcpy(traceName[st - sensorState], sensor); }
+        traceSamples[nTraceSamples].key = key;
+        traceSamples[nTraceSamples].slot = st - sensorState;
+        traceSamples[nTraceSamples].kind = kind;
+        traceSamples[nTraceSamples].value = value;
+        traceSamples[nTraceSamples].ts = ts;
+        traceSamples[nTraceSamples].seq = nTraceSamples;
+        nTraceSamples++;
+    }
+    if ( nTraceSamples == 0 ) {
+        fprintf(stderr, "Error: no line protocol from this tool on stdin\n");
+        return -1;
+    }
+
+    qsort(traceSamples, nTraceSamples, sizeof(TraceSample_t), _traceCompare);
+    return 0;
+}
+
+
+
+// fold one batch of readings into the per-sensor and pairwise statistics
+void _traceRow(void)
+{
+    int i, j;
+
+    for (i = 0; i < nSensorState; i++) {
+        if ( !traceSeen[i] ) { continue; }
+        Baseline_t* b = &sensorState[i].base[0];
+        double delta = traceRow[i] - b->mean;
+        b->n++;
+        b->mean += delta / b->n;
+        b->m2 += delta * (traceRow[i] - b->mean);
+
+        for (j = i + 1; j < nSensorState; j++) {
+            if ( !traceSeen[j] ) { continue; }
+            CoMoment_t* c = &coMoment[i][j];
+            double dx = traceRow[i] - c->meanX;
+            double dy = traceRow[j] - c->meanY;
+            c->n++;
+            c->meanX += dx / c->n;
+            c->meanY += dy / c->n;
+            c->cXX += dx * (traceRow[i] - c->meanX);
+            c->cYY += dy * (traceRow[j] - c->meanY);
+            c->cXY += dx * (traceRow[j] - c->meanY);
+        }
+    }
+    memset(traceSeen, 0, sizeof(traceSeen));
+}
+
+
+
+double _traceCorr(int i, int j)
+{
+    CoMoment_t* c = i < j ? &coMoment[i][j] : &coMoment[j][i];
+
+    if ( i == j ) { return 1.0; }
+    if ( c->n < BASELINE_WARMUP || c->cXX <= 0.0 || c->cYY <= 0.0 ) { return 0.0; }
+    return c->cXY / sqrt(c->cXX * c->cYY);
+}
+
+
+
+double _traceSd(int i)
+{
+    Baseline_t* b = &sensorState[i].base[0];
+    return b->n > 1 ? sqrt(b->m2 / (b->n - 1)) : 0.0;
+}
+
+
+
+// R squared of each active sensor regressed on all other active sensors, 1 - 1/diag(inverse(R))
+int _traceR2(int* active, int n, double* r2)
+{
+    int i, j, k, pivot;
+    double f;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            // a small ridge keeps near-duplicate sensors from making R singular
+            corrWork[i][j] = _traceCorr(active[i], active[j]) + ( i == j ? 1e-6 : 0.0 );
+            corrWork[i][n + j] = ( i == j );
+        }
+    }
+
+    // Gauss-Jordan with partial pivoting
+    for (i = 0; i < n; i++) {
+        pivot = i;
+        for (k = i + 1; k < n; k++) {
+            if ( fabs(corrWork[k][i]) > fabs(corrWork[pivot][i]) ) { pivot = k; }
+        }
+        if ( fabs(corrWork[pivot][i]) < 1e-12 ) { return -1; }
+        if ( pivot != i ) {
+            for (j = 0; j < 2 * n; j++) {
+                f = corrWork[i][j]; corrWork[i][j] = corrWork[pivot][j]; corrWork[pivot][j] = f;
+            }
+        }
+        f = corrWork[i][i];
+        for (j = 0; j < 2 * n; j++) { corrWork[i][j] /= f; }
+        for (k = 0; k < n; k++) {
+            if ( k == i || corrWork[k][i] == 0.0 ) { continue; }
+            f = corrWork[k][i];
+            for (j = 0; j < 2 * n; j++) { corrWork[k][j] -= f * corrWork[i][j]; }
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        r2[i] = 1.0 - 1.0 / corrWork[i][n + i];
+        if ( r2[i] < 0.0 ) { r2[i] = 0.0; }
+    }
+    return 0;
+}
+
+
+
+// read recorded line protocol on stdin and report which sensors the others already explain
+int analyseTrace(double maxResidual)
+{
+    double r2[MAX_SENSORS];
+    long t, lastTs = 0;
+    int active[MAX_SENSORS], nActive = 0;
+    int i, j, n, best, len = 0;
+    char drop[MAX_SENSORS * 8 + 1];
+    UInt32Char_t k;
+
+    if ( loadTrace() != 0 ) { return 1; }
+
+    // one row per timestamp, the lines of a batch share one
+    for (t = 0; t < nTraceSamples; t++) {
+        if ( traceSamples[t].ts != lastTs ) {
+            _traceRow();
+            lastTs = traceSamples[t].ts;
+        }
+        traceRow[traceSamples[t].slot] = traceSamples[t].value;
+        traceSeen[traceSamples[t].slot] = 1;
+    }
+    _traceRow();
+
+    // constant or barely sampled sensors carry no information to correlate
+    for (i = 0; i < nSensorState; i++) {
+        if ( sensorState[i].base[0].n >= BASELINE_WARMUP && _traceSd(i) > 0.0 ) { active[nActive++] = i; }
+    }
+    if ( _traceR2(active, nActive, r2) != 0 ) { memset(r2, 0, sizeof(r2)); }
+
+    printf("%-24s %-4s %8s %8s  %-24s %6s %6s %8s\n", "sensor", "key", "samples", "sd", "best", "r", "R2", "resid");
+    for (i = 0, n = 0; i < nSensorState; i++) {
+        _ultostr(k, sensorState[i].key);
+        for (best = -1, j = 0; j < nSensorState; j++) {
+            if ( j != i && ( best < 0 || fabs(_traceCorr(i, j)) > fabs(_traceCorr(i, best)) ) ) { best = j; }
+        }
+        printf("%-24s %-4s %8ld %8.3f  %-24s %6.3f", traceName[i], k, sensorState[i].base[0].n, _traceSd(i),
+            best < 0 ? "-" : traceName[best], best < 0 ? 0.0 : _traceCorr(i, best));
+        if ( n < nActive && active[n] == i ) {
+            printf(" %6.3f %8.3f", r2[n], _traceSd(i) * sqrt(1.0 - r2[n]));
+            n++;
+        }
+        printf("\n");
+    }
+
+    printf("\nredundant:\n");
+    for (i = 0; i < nSensorState; i++) {
+        if ( sensorState[i].base[0].n >= BASELINE_WARMUP && _traceSd(i) == 0.0 ) {
+            _ultostr(k, sensorState[i].key);
+            printf("%-24s %-4s constant\n", traceName[i], k);
+            len += sprintf(&drop[len], " -x %s", k);
+        }
+    }
+
+    // greedily drop the sensor best reconstructed from the rest until none is within maxResidual
+    while ( nActive > 1 && _traceR2(active, nActive, r2) == 0 ) {
+        for (best = -1, i = 0; i < nActive; i++) {
+            if ( _traceSd(active[i]) * sqrt(1.0 - r2[i]) > maxResidual ) { continue; }
+            if ( best < 0 || r2[i] > r2[best] ) { best = i; }
+        }
+        if ( best < 0 ) { break; }
+
+        _ultostr(k, sensorState[active[best]].key);
+        printf("%-24s %-4s R2=%.3f resid=%.3f\n", traceName[active[best]], k,
+            r2[best], _traceSd(active[best]) * sqrt(1.0 - r2[best]));
+        len += sprintf(&drop[len], " -x %s", k);
+        active[best] = active[--nActive];
+    }
+    if ( len > 0 ) { printf("\ndrop with:%s\n", drop); }
+
+    return 0;
+}
+
+
+
+// -R replays a recorded trace through the anomaly, episode and forecast code under several settings
+#define MAX_SWEEP 64
+
+typedef struct {
+    double sigma;
+    int run;
+    double rise;
+} Setting_t;
+
+Setting_t sweep[MAX_SWEEP];
+int nSweep = 0;
+long nReplay = 0;
+
+
+
+// parse sigma/run[/rise] settings separated by commas, a zero sigma or rise turns that part off
+int _sweepParse(char* arg)
+{
+    char* item;
+    int n;
+
+    for (item = strtok(arg, ","); item != NULL; item = strtok(NULL, ",")) {
+        if ( nSweep == MAX_SWEEP ) { return -1; }
+        sweep[nSweep].rise = 0.0;
+        n = sscanf(item, "%lf/%d/%lf", &sweep[nSweep].sigma, &sweep[nSweep].run, &sweep[nSweep].rise);
+        if ( n < 2 || sweep[nSweep].sigma < 0.0 || sweep[nSweep].run < 1 || sweep[nSweep].rise < 0.0 ) { return -1; }
+        nSweep++;
+    }
+    return nSweep > 0 ? 0 : -1;
+}
+
+
+
+// run one setting over the whole trace from a clean state, the counts go back through fd
+int _replayRun(int index, int fd)
+{
+    Setting_t* set = &sweep[index];
+    TraceSample_t* r;
+    UInt32Char_t k;
+    long i, nAnomalies = 0, nEpisodeLines = 0, nErrors = 0, lastTs = 0;
+    double forecast, error, sumSq = 0.0;
+    char row[256];
+    int before, len;
+
+    nSensorState = 0;
+    nEpisodes = 0;
+    anomalySigma = set->sigma;
+    anomalyRun = set->run;
+    episodeRise = set->rise;
+
+    // the trace is in time order, so ens only moves forward as it would have in collect()
+    for (i = 0; i <= nTraceSamples; i++) {
+        r = &traceSamples[i];
+        if ( i < nTraceSamples && r->kind == SAMPLE_OTHER ) { continue; }
+
+        // a new timestamp closes the previous batch, as the end of collect() does
+        if ( i == nTraceSamples || r->ts != lastTs ) {
+            if ( episodeRise > 0.0 && lastTs != 0 ) {
+                before = nLines;
+                influxEpisodes();
+                nEpisodeLines += nLines - before;
+            }
+            batchLen = 0;
+            if ( i == nTraceSamples ) { break; }
+            ens = lastTs = r->ts;
+        }
+
+        _ultostr(k, r->key);
+        if ( anomalySigma > 0.0 ) {
+            before = nLines;
+            _anomalyScore(k, traceName[r->slot], r->kind == SAMPLE_FAN ? "rpm" : "temp", r->value);
+            nAnomalies += nLines - before;
+        }
+        if ( r->kind == SAMPLE_FAN ) { continue; }
+        if ( forecasting && _forecast(k, r->value, &forecast, &error) == 0 ) {
+            sumSq += error * error;
+            nErrors++;
+        }
+        if ( episodeRise > 0.0 ) { _episodeSample(traceName[r->slot], r->value); }
+    }
+
+    len = sprintf(row, "%6.2f %4d %6.2f %9ld %9ld %9ld %9ld", set->sigma, set->run, set->rise, nReplay,
+        nAnomalies, nEpisodeLines, nReplay + nAnomalies + nEpisodeLines);
+    if ( nErrors > 0 ) {
+        len += sprintf(&row[len], " %8.3f\n", sqrt(sumSq / nErrors));
+    } else {
+        len += sprintf(&row[len], " %8s\n", "-");
+    }
+
+    // one write, well under PIPE_BUF, so the row arrives whole
+    return write(fd, row, len) == len ? 0 : 1;
+}
+
+
+
+// print one worker's row in sweep order once it has finished
+void _replayReap(int index, pid_t pid, int fd)
+{
+    char row[256];
+    ssize_t n, len = 0;
+    int status;
+
+    while ( ( n = read(fd, &row[len], sizeof(row) - 1 - len) ) > 0 ) { len += n; }
+    close(fd);
+    waitpid(pid, &status, 0);
+    if ( len > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 ) {
+        row[len] = '\0';
+        fputs(row, stdout);
+    } else {
+        printf("%6.2f %4d %6.2f failed\n", sweep[index].sigma, sweep[index].run, sweep[index].rise);
+    }
+}
+
+
+
+int backtest(void)
+{
+    long t, started = _monotonicUs(), nBatches = 0, lastTs = 0;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    pid_t pid[MAX_SWEEP];
+    int fd[MAX_SWEEP], p[2], i, done = 0;
+
+    // the trace is held in memory, in time order, so every worker replays it at full speed
+    if ( loadTrace() != 0 ) { return 1; }
+    for (t = 0; t < nTraceSamples; t++) {
+        if ( traceSamples[t].kind == SAMPLE_OTHER ) { continue; }
+        if ( traceSamples[t].ts != lastTs ) {
+            nBatches++;
+            lastTs = traceSamples[t].ts;
+        }
+        nReplay++;
+    }
+    if ( nReplay == 0 ) {
+        fprintf(stderr, "Error: no temperature or fan lines on stdin\n");
+        return 1;
+    }
+
+    fflush(stdout);
+    printf("%6s %4s %6s %9s %9s %9s %9s %8s\n", "sigma", "run", "rise", "samples", "anomaly", "episode", "points", "ferr");
+
+    // one worker per setting, at most one per core, rows are printed in the order given
+    if ( ncpu < 1 ) { ncpu = 1; }
+    for (i = 0; i < nSweep; i++) {
+        if ( i - done == ncpu ) {
+            _replayReap(done, pid[done], fd[done]);
+            done++;
+        }
+        fflush(stdout);
+        if ( pipe(p) != 0 || ( pid[i] = fork() ) == -1 ) {
+            fprintf(stderr, "Error: cannot start a worker\n");
+            return 1;
+        }
+        if ( pid[i] == 0 ) {
+            close(p[0]);
+            _exit(_replayRun(i, p[1]));
+        }
+        close(p[1]);
+        fd[i] = p[0];
+    }
+    while ( done < nSweep ) {
+        _replayReap(done, pid[done], fd[done]);
+        done++;
+    }
+
+    printf("\n%ld samples in %ld batches from %d sensors, %d settings on %ld workers in %.1f ms\n",
+        nReplay, nBatches, nSensorState, nSweep, ncpu < nSweep ? ncpu : nSweep, ( _monotonicUs() - started ) / 1000.0);
+
+    return 0;
+}
+
+
+
+// connect to the -u socket, non-blocking so a stalled reader can never hold up collection
+int _sinkConnect(void)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sinkPath, sizeof(addr.sun_path) - 1);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ( fd == -1 ) { return -1; }
+    if ( fcntl(fd, F_SETFL, O_NONBLOCK) == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ) {
+        close(fd);
+        return -1;
+    }
+
+    sinkFd = fd;
+    return 0;
+}
+
+
+
+// a line cut short by a lost connection is dropped, the reader would only reject it
+void _sinkClose(void)
+{
+    char* nl;
+
+    close(sinkFd);
+    sinkFd = -1;
+
+    if ( sinkPartial ) {
+        nl = memchr(sinkQueue, '\n', sinkLen);
+        size_t cut = nl != NULL ? nl - sinkQueue + 1 : sinkLen;
+        memmove(sinkQueue, &sinkQueue[cut], sinkLen - cut);
+        sinkLen -= cut;
+        sinkPartial = 0;
+    }
+}
+
+
+
+// queue a batch, making room by dropping the oldest whole lines but never one partly written
+void _sinkEnqueue(const char* data, size_t len)
+{
+    size_t keep = 0, cut;
+    char* nl;
+
+    if ( len > SINK_QUEUE_SIZE / 2 ) { return; }
+
+    if ( sinkLen + len > SINK_QUEUE_SIZE ) {
+        if ( sinkPartial ) {
+            nl = memchr(sinkQueue, '\n', sinkLen);
+            keep = nl != NULL ? nl - sinkQueue + 1 : sinkLen;
+        }
+        for (cut = keep; sinkLen - ( cut - keep ) + len > SINK_QUEUE_SIZE; cut = nl - sinkQueue + 1) {
+            nl = memchr(&sinkQueue[cut], '\n', sinkLen - cut);
+            if ( nl == NULL ) { break; }
+            nDropped++;
+        }
+        memmove(&sinkQueue[keep], &sinkQueue[cut], sinkLen - cut);
+        sinkLen -= cut - keep;
+    }
+
+    memcpy(&sinkQueue[sinkLen], data, len);
+    sinkLen += len;
+}
+
+
+
+// the whole of -I runs on this one loop: it drains the queue, waits for the deadline and
+// reconnects with exponential backoff, sleeping in poll() only on what can make progress
+void _sinkRun(long deadline, int untilEmpty)
+{
+    struct pollfd pfd;
+    long now, wake;
+    ssize_t n;
+
+    while ( running ) {
+        now = _monotonicUs();
+
+        if ( sinkPath != NULL && sinkLen > 0 && sinkFd == -1 && now >= sinkRetryAt ) {
+            if ( _sinkConnect() == 0 ) {
+                sinkBackoff = SINK_BACKOFF_MIN;
+            } else {
+                sinkRetryAt = now + sinkBackoff;
+                sinkBackoff = sinkBackoff * 2 > SINK_BACKOFF_MAX ? SINK_BACKOFF_MAX : sinkBackoff * 2;
+            }
+        }
+
+        if ( sinkFd != -1 && sinkLen > 0 ) {
+            n = write(sinkFd, sinkQueue, sinkLen);
+            usSink += _monotonicUs() - now;
+            if ( n > 0 ) {
+                sinkPartial = sinkQueue[n - 1] != '\n';
+                memmove(sinkQueue, &sinkQueue[n], sinkLen - n);
+                sinkLen -= n;
+                continue;
+            }
+            if ( n == -1 && errno != EAGAIN && errno != EINTR ) {
+                _sinkClose();
+                sinkRetryAt = now;
+                continue;
+            }
+        }
+
+        if ( untilEmpty && sinkLen == 0 ) { return; }
+        if ( now >= deadline ) { return; }
+
+        // sleep until the socket can take more, the next reconnect attempt or the deadline
+        wake = deadline;
+        if ( sinkFd == -1 && sinkLen > 0 && sinkRetryAt < wake ) { wake = sinkRetryAt; }
+        pfd.fd = sinkFd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        poll(&pfd, sinkFd != -1 && sinkLen > 0, ( wake - now + 999 ) / 1000);
+        nWakeups++;
+    }
+}
+
+
+
+void _stop(int sig)
+{
+    running = 0;
+}
+
+
+
+// SIGHUP under -I, hand over to whatever binary is now at our path
+void _upgrade(int sig)
+{
+    upgrading = 1;
+    running = 0;
+}
+
+
+
+// exec ourselves again with the socket, the unsent queue and the tick schedule, returns only on failure
+#define HANDOFF_ENV "INFLUXDB_SMC_HANDOFF"
+
+void _handoff(char* argv[], long next)
+{
+    char path[] = "/tmp/influxdb-smc.XXXXXX";
+    char env[256];
+    size_t done = 0;
+    ssize_t n;
+    int fd;
+
+    // the state file is already written for this tick, exec closes it and so drops the lock,
+    // which the new process takes again in loadState(), another -S run could take it in between
+    if ( stateFd != -1 ) { fcntl(stateFd, F_SETFD, FD_CLOEXEC); }
+
+    // the queue can be larger than a pipe holds, an unlinked file carries it across
+    fd = mkstemp(path);
+    if ( fd == -1 ) {
+        fprintf(stderr, "Error: cannot save the queue for upgrade\n");
+        return;
+    }
+    unlink(path);
+    while ( done < sinkLen && ( n = write(fd, &sinkQueue[done], sinkLen - done) ) > 0 ) { done += n; }
+    if ( done < sinkLen || lseek(fd, 0, SEEK_SET) != 0 ) {
+        fprintf(stderr, "Error: cannot save the queue for upgrade\n");
+        close(fd);
+        return;
+    }
+
+    snprintf(env, sizeof(env), "%d,%d,%d,%ld,%ld,%ld,%ld,%ld,%ld",
+        sinkFd, fd, sinkPartial, next, nDropped, nWakeups, usRead, usFormat, usSink);
+    setenv(HANDOFF_ENV, env, 1);
+    fflush(stdout);
+    SMCClose();
+
+    execvp(argv[0], argv);
+
+    // still the old binary, carry on as if nothing happened
+    fprintf(stderr, "Error: cannot exec '%s' for upgrade\n", argv[0]);
+    unsetenv(HANDOFF_ENV);
+    close(fd);
+    SMCOpen();
+}
+
+
+
+// take over what the process that exec'd us handed over, returns its next tick or 0 on a normal start
+long _handoffRestore(void)
+{
+    char* env = getenv(HANDOFF_ENV);
+    int fd, sockFd, partial;
+    long next;
+    ssize_t n;
+
+    if ( env == NULL ) { return 0; }
+    n = sscanf(env, "%d,%d,%d,%ld,%ld,%ld,%ld,%ld,%ld",
+        &sockFd, &fd, &partial, &next, &nDropped, &nWakeups, &usRead, &usFormat, &usSink);
+    unsetenv(HANDOFF_ENV);
+    if ( n != 9 ) { return 0; }
+
+    while ( sinkLen < SINK_QUEUE_SIZE && ( n = read(fd, &sinkQueue[sinkLen], SINK_QUEUE_SIZE - sinkLen) ) > 0 ) {
+        sinkLen += n;
+    }
+    close(fd);
+
+    // the socket is only kept when this binary was started to write to one
+    if ( sinkPath != NULL ) {
+        sinkFd = sockFd;
+        sinkPartial = partial;
+    } else {
+        if ( sockFd != -1 ) { close(sockFd); }
+        sinkLen = 0;
+    }
+
+    return next;
+}
+
+
+
+// one collection, from claiming a sequence number to handing the batch to the sink
+void collect(int sel)
+{
+    struct timespec spec;
+    long readBefore = usRead;
+    long started;
+
+    // get ns epoch
+    clock_gettime(CLOCK_REALTIME, &spec);
+    ens = spec.tv_sec * 1000000000 + spec.tv_nsec;
+
+    batchLen = 0;
+    nLines = nSkipped = nSuppressed = 0;
+    nSnmpRows[0] = nSnmpRows[1] = 0;
+
+    // claim the next sequence number up front, a run that dies later shows up as a gap
+    if ( stateFd != -1 ) {
+        batchSeq++;
+        if ( saveState() != 0 ) { fprintf(stderr, "Error: cannot write state file\n"); }
+    }
+
+    loadLevel = _loadLevel();
+    collectStart = _monotonicUs();
+
+    if ( sel & WANT_ALL ) {
+        influxSMCtemps(allTemps, sizeof(allTemps) / sizeof(allTemps[0]));
+        influxSMCfans();
+    } else {
+        if ( sel & WANT_CPU ) { influxSMCtemp("TC0P","CPU"); }
+        if ( sel & WANT_GPU ) { influxSMCtemp("TG0P","GPU"); }
+        if ( sel & WANT_SSD ) { influxSMCtemp("TH0X","SSD"); }
+        if ( sel & WANT_WIFI ) { influxSMCtemp("TW0P","WiFi"); }
+        if ( sel & WANT_FAN ) { influxSMCfans(); }
+    }
+
+    if ( episodeRise > 0.0 ) { influxEpisodes(); }
+
+    if ( sel & WANT_BATTERY ) { influxSMCbattery(); }
+
+    if ( sel & WANT_POWER ) {
+        influxSMCpower("PSTR","System");
+        influxSMCpower("PDTR","DC-In");
+        influxSMCpower("PCPT","CPU-Package");
+        influxSMCpower("PCPC","CPU-Cores");
+        influxSMCpower("PCPG","CPU-Graphics");
+        influxSMCpower("PG0R","GPU");
+    }
+
+    // everything since the start of the reads that was not an SMC round trip, the key cache merge below is file I/O and stays out
+    usFormat += _monotonicUs() - collectStart - ( usRead - readBefore );
+
+    // keys resolved for the first time are merged into the cache and the cache is mapped again
+    if ( keyCachePath != NULL && nKeyCacheNew > 0 ) {
+        if ( saveKeyCache(keyCachePath) != 0 || loadKeyCache(keyCachePath) != 0 ) {
+            fprintf(stderr, "Error: cannot write key cache '%s'\n", keyCachePath);
+        }
+    }
+
+    if ( stateFd != -1 ) {
+        influxBatch();
+        if ( saveState() != 0 ) { fprintf(stderr, "Error: cannot write state file\n"); }
+    }
+
+    // -N answers from the batch instead of writing it
+    if ( snmpMode ) { return; }
+
+    // the batch is already formatted, so its own sink time shows up on the next collector line
+    started = _monotonicUs();
+    if ( sinkPath != NULL ) {
+        _sinkEnqueue(batchBuf, batchLen);
+    } else {
+        fwrite(batchBuf, 1, batchLen, stdout);
+        fflush(stdout);
+    }
+    usSink += _monotonicUs() - started;
+}
+
+
+
+// -N net-snmp pass_persist subagent, every answer comes from the last collection
+#define MAX_OID 64
+
+int snmpBase[MAX_OID];
+int nSnmpBase = 0;
+
+
+
+int _oidParse(const char* str, int* oid, int max)
+{
+    int n = 0;
+    char* end;
+
+    while ( *str == '.' && n < max ) {
+        oid[n++] = strtol(str + 1, &end, 10);
+        if ( end == str + 1 ) { return -1; }
+        str = end;
+    }
+    return *str == '\0' || *str == '\n' ? n : -1;
+}
+
+
+
+int _oidCompare(const int* a, int na, const int* b, int nb)
+{
+    int i;
+
+    for (i = 0; i < na && i < nb; i++) {
+        if ( a[i] != b[i] ) { return a[i] < b[i] ? -1 : 1; }
+    }
+    return na < nb ? -1 : na > nb;
+}
+
+
+
+int _snmpRowCompare(const void* a, const void* b)
+{
+    return ( (const SnmpRow_t*)a )->index - ( (const SnmpRow_t*)b )->index;
+}
+
+
+
+// number rows by where the sensor sits in allTemps or by fan number, so a row keeps its OID from one
+// collection to the next and a sensor that was not written leaves a gap rather than moving the rest up
+void _snmpIndex(void)
+{
+    int i, j, n = sizeof(allTemps) / sizeof(allTemps[0]);
+
+    for (i = 0; i < nSnmpRows[0]; i++) {
+        for (j = 0; j < n && strcmp(allTemps[j].key, snmpRows[0][i].key) != 0; j++) { }
+        snmpRows[0][i].index = j < n ? j : n + i;
+    }
+    for (i = 0; i < nSnmpRows[1]; i++) {
+        snmpRows[1][i].index = atoi(&snmpRows[1][i].key[1]);
+    }
+
+    qsort(snmpRows[0], nSnmpRows[0], sizeof(SnmpRow_t), _snmpRowCompare);
+    qsort(snmpRows[1], nSnmpRows[1], sizeof(SnmpRow_t), _snmpRowCompare);
+}
+
+
+
+// the index-th object in OID order, columns name, key and value of each table, rows as numbered by _snmpIndex
+int _snmpObject(int index, int* oid, char* type, char* value)
+{
+    int table, column, row, n;
+
+    for (table = 0; table < 2; table++) {
+        if ( index < 3 * nSnmpRows[table] ) { break; }
+        index -= 3 * nSnmpRows[table];
+    }
+    if ( table == 2 ) { return -1; }
+
+    column = index / nSnmpRows[table];
+    row = index % nSnmpRows[table];
+
+    memcpy(oid, snmpBase, nSnmpBase * sizeof(int));
+    n = nSnmpBase;
+    oid[n++] = table + 1;
+    oid[n++] = column + 1;
+    SnmpRow_t* r = &snmpRows[table][row];
+    oid[n++] = r->index + 1;
+
+    if ( column == 0 ) {
+        strcpy(type, "string");
+        strcpy(value, r->sensor);
+    } else if ( column == 1 ) {
+        strcpy(type, "string");
+        strcpy(value, r->key);
+    } else if ( table == 0 ) {
+        // SNMP has no floating point, temperatures stay in hundredths of a degree
+        strcpy(type, "integer");
+        sprintf(value, "%ld", r->value);
+    } else {
+        strcpy(type, "gauge");
+        sprintf(value, "%ld", ( r->value + 50 ) / 100);
+    }
+    return n;
+}
+
+
+
+// speak pass_persist on stdin and stdout, collecting at most once per refresh however often snmpd asks
+int snmpServe(int sel, int refresh)
+{
+    char command[64], request[512], type[16], value[64];
+    int want[MAX_OID], oid[MAX_OID];
+    int nWant, n, i, next, found;
+    long collected = 0;
+
+    while ( fgets(command, sizeof(command), stdin) != NULL ) {
+        command[strcspn(command, "\r\n")] = '\0';
+
+        if ( strcmp(command, "PING") == 0 ) {
+            printf("PONG\n");
+        } else if ( strcmp(command, "get") == 0 || strcmp(command, "getnext") == 0 ) {
+            if ( fgets(request, sizeof(request), stdin) == NULL ) { break; }
+            next = command[3] == 'n';
+
+            if ( collected == 0 || _monotonicUs() - collected >= refresh * 1000000L ) {
+                collect(sel);
+                _snmpIndex();
+                collected = _monotonicUs();
+            }
+
+            found = 0;
+            nWant = _oidParse(request, want, MAX_OID);
+            for (i = 0; nWant > 0 && ( n = _snmpObject(i, oid, type, value) ) > 0; i++) {
+                int cmp = _oidCompare(oid, n, want, nWant);
+                if ( ( !next && cmp == 0 ) || ( next && cmp > 0 ) ) {
+                    for (found = 0; found < n; found++) { printf(".%d", oid[found]); }
+                    printf("\n%s\n%s\n", type, value);
+                    break;
+                }
+            }
+            if ( !found ) { printf("NONE\n"); }
+        } else if ( strcmp(command, "set") == 0 ) {
+            if ( fgets(request, sizeof(request), stdin) == NULL || fgets(request, sizeof(request), stdin) == NULL ) { break; }
+            printf("not-writable\n");
+        } else {
+            break;
+        }
+        fflush(stdout);
+    }
+
+    return 0;
+}
+
+
+
+int main(int argc, char* argv[])
+{
+    int status;
+    char hostnameFull[265];
+
+    // stdout is block buffered into a static buffer so the batch goes out in as few writes as possible
+    setvbuf(stdout, outBuf, _IOFBF, sizeof(outBuf));
+
+    // get hostname
+    status = gethostname( &hostnameFull[0], 256 );
+    if ( status == -1 ) { strcpy(hostnameFull, "NULL"); }
+    hostnameFull[256] = '\0';
+
+    // strip domain from hostname, if there is one
+    char *hostnameFullPtr = strchr(hostnameFull, '.');
+    if ( hostnameFullPtr != NULL ) { *hostnameFullPtr = '\0'; }
+    strcpy(hostname, hostnameFull);
+    
+    // capatalise first letter of hostname
+    if ( hostname[0]>='a' && hostname[0]<='z' ) {
+        hostname[0]=hostname[0]-32;
+    }
+
+    // pass options
+    int cpu = 0;
+    int gpu = 0;
+    int wfi = 0;
+    int ssd = 0;
+    int fan = 0;
+    int all = 0;
+    int tag = 0;
+    int mdl = 0;
+    int pwr = 0;
+    int bat = 0;
+    char* value;
+    char tagName[sizeof(hostTag)];
+    char* statePath = NULL;
+    double maxResidual = 0.0;
+    int interval = 0;
+    long resumeAt;
+
+    int args;
+    while ((args = getopt(argc, argv, "aAbcefFghwsnMt:x:i:r:m:S:k:K:E:C:R:B:P:u:I:N:?")) != -1) {
+        switch (args) {
+        case 'a':
+            cpu = 1;
+            gpu = 1;
+            fan = 1;
+            wfi = 1;
+            ssd = 1;
+            break;
+        case 'A':
+            all = 1;
+            break;
+        case 'b':
+            bat = 1;
+            break;
+        case 'c':
+            cpu = 1;
+            break;
+        case 'e':
+            pwr = 1;
+            break;
+        case 'F':
+            forecasting = 1;
+            break;
+        case 'f':
+            fan = 1;
+            break;
+        case 'g':
+            gpu = 1;
+            break;
+        case 'w':
+            wfi = 1;
+            break;
+        case 's':
+            ssd = 1;
+            break;
+        case 'n':
+            tag = 1;
+            break;
+        case 'M':
+            mdl = 1;
+            break;
+        case 't':
+            // a backslash has no escape every reader agrees on and an empty value is no tag, both are refused
+            value = strchr(optarg, '=');
+            if ( value == NULL || value == optarg || value[1] == '\0' || strchr(optarg, '\\') != NULL ) {
+                fprintf(stderr, "Error: -t expects name=value, got '%s'\n", optarg);
+                return -1;
+            }
+            // copied out rather than cut in place, SIGHUP execs again with these same arguments
+            snprintf(tagName, sizeof(tagName), "%.*s", (int)( value - optarg ), optarg);
+            if ( _addTag(tagName, value + 1) != 0 ) {
+                fprintf(stderr, "Error: too many tags\n");
+                return -1;
+            }
+            break;
+        case 'x':
+            if ( nDropKeys == MAX_RULES || nDropPatterns == MAX_RULES ) {
+                fprintf(stderr, "Error: too many -x rules\n");
+                return -1;
+            }
+            // plain keys stay integer compares, anything else is a pattern on key or sensor name
+            if ( strlen(optarg) == 4 && strpbrk(optarg, "*?[") == NULL ) {
+                dropKeys[nDropKeys++] = _strtoul(optarg, 4, 16);
+            } else {
+                dropPatterns[nDropPatterns++] = optarg;
+            }
+            break;
+        case 'i':
+            if ( nAllowPatterns == MAX_RULES ) {
+                fprintf(stderr, "Error: too many -i rules\n");
+                return -1;
+            }
+            allowPatterns[nAllowPatterns++] = optarg;
+            break;
+        case 'm':
+            maxSeries = atoi(optarg);
+            if ( maxSeries < 1 ) {
+                fprintf(stderr, "Error: -m expects a positive number of series\n");
+                return -1;
+            }
+            break;
+        case 'r':
+            // the name goes into lines as is, so nothing that would need escaping
+            value = strchr(optarg, '=');
+            if ( value == NULL || value - optarg != 4 || value[1] == '\0' || strpbrk(value + 1, ", =\\") != NULL ||
+                 nRenameKeys == MAX_RULES ) {
+                fprintf(stderr, "Error: -r expects KEY=name, got '%s'\n", optarg);
+                return -1;
+            }
+            renameKeys[nRenameKeys] = _strtoul(optarg, 4, 16);
+            renameNames[nRenameKeys++] = value + 1;
+            break;
+        case 'S':
+            statePath = optarg;
+            break;
+        case 'k':
+            anomalySigma = atof(optarg);
+            if ( anomalySigma <= 0.0 ) {
+                fprintf(stderr, "Error: -k expects a positive number of standard deviations\n");
+                return -1;
+            }
+            break;
+        case 'K':
+            anomalyRun = atoi(optarg);
+            if ( anomalyRun < 1 ) {
+                fprintf(stderr, "Error: -K expects a positive number of samples\n");
+                return -1;
+            }
+            break;
+        case 'P':
+            keyCachePath = optarg;
+            break;
+        case 'u':
+            sinkPath = optarg;
+            break;
+        case 'N':
+            nSnmpBase = _oidParse(optarg, snmpBase, MAX_OID - 3);
+            if ( nSnmpBase < 1 ) {
+                fprintf(stderr, "Error: -N expects a numeric OID such as .1.3.6.1.4.1.8072.9999.9999.1\n");
+                return -1;
+            }
+            snmpMode = 1;
+            break;
+        case 'I':
+            interval = atoi(optarg);
+            if ( interval < 1 ) {
+                fprintf(stderr, "Error: -I expects a positive number of seconds\n");
+                return -1;
+            }
+            break;
+        case 'E':
+            episodeRise = atof(optarg);
+            if ( episodeRise <= 0.0 ) {
+                fprintf(stderr, "Error: -E expects a positive rise in degrees\n");
+                return -1;
+            }
+            break;
+        case 'B':
+            readBudget = atof(optarg) * 1000.0;
+            if ( readBudget <= 0.0 ) {
+                fprintf(stderr, "Error: -B expects a positive number of milliseconds\n");
+                return -1;
+            }
+            break;
+        case 'C':
+            maxResidual = atof(optarg);
+            if ( maxResidual <= 0.0 ) {
+                fprintf(stderr, "Error: -C expects a positive residual\n");
+                return -1;
+            }
+            break;
+        case 'R':
+            if ( _sweepParse(optarg) != 0 ) {
+                fprintf(stderr, "Error: -R expects up to %d settings sigma/run[/rise], e.g. 3/3/5,2.5/5/5\n", MAX_SWEEP);
+                return -1;
+            }
+            break;
+        case 'h':
+        case '?':
+            printf("usage: influxdb-smc [aAbcefFghwsnM] [-t tag=value] [-x pattern] [-i pattern] [-r KEY=name] [-m series] [-S file] [-k sigma] [-K samples] [-E rise] [-C residual] [-R sigma/run/rise,...] [-B ms] [-P file] [-u socket] [-I seconds] [-N oid]\n");
+            printf("  -c  CPU temperature\n");
+            printf("  -g  GPU temperature\n");
+            printf("  -w  WiFi temperature\n");
+            printf("  -s  SSD temperature\n");
+            printf("  -f  fan speeds\n");
+            printf("  -e  power and energy since the previous run, needs -S\n");
+            printf("  -b  battery voltage, current, capacity and cycle count\n");
+            printf("  -a  CPU, GPU and fans - same as -cgf\n");
+            printf("  -A  all temperature and fan metrics\n");
+            printf("  -n  tag with hostname\n");
+            printf("  -M  tag with hardware model\n");
+            printf("  -t  add tag=value to every line, may be repeated\n");
+            printf("  -x  drop sensors whose SMC key or name matches pattern, may be repeated\n");
+            printf("  -i  only keep sensors whose SMC key or name matches pattern, may be repeated\n");
+            printf("  -r  rename the sensor with SMC key KEY, may be repeated\n");
+            printf("  -m  write at most this many distinct series, first seen keep their place, needs -S\n");
+            printf("  -S  keep state in file and add a collector line with the batch sequence number\n");
+            printf("  -k  score readings against their baseline and report deviations beyond sigma, needs -S\n");
+            printf("  -K  samples a deviation must last before it is reported, default 3\n");
+            printf("  -F  forecast each temperature one run ahead, needs -S\n");
+            printf("  -E  summarise episodes that rise this many degrees above baseline, needs -S\n");
+            printf("  -B  spend at most ms reading -A temperatures, slow low priority keys rotate in, needs -S\n");
+            printf("  -P  cache SMC key types and sizes in file and skip keys this machine lacks\n");
+            printf("  -u  write batches to a Unix stream socket, e.g. Telegraf socket_listener, instead of stdout\n");
+            printf("  -I  keep running and collect every so many seconds, SIGHUP execs the binary again in place\n");
+            printf("  -N  serve readings under oid as a net-snmp pass_persist subagent, refreshed every -I seconds\n");
+            printf("  -C  read recorded output on stdin and list sensors the others predict within residual\n");
+            printf("  -R  replay recorded output on stdin with each anomaly and episode setting, -F adds forecast error\n");
+            printf("  -h  this info\n");
+            return -1;
+        }
+    }
+
+    // analysis of a recorded trace, the SMC is not touched
+    if ( maxResidual > 0.0 ) { return analyseTrace(maxResidual); }
+    if ( nSweep > 0 ) { return backtest(); }
+
+    // tag with hostname -n and model -M, ahead of any -t tags
+    if ( tag || mdl ) {
+        char extraTags[sizeof(hostTag)];
+        strcpy(extraTags, hostTag);
+        hostTag[0] = '\0';
+        if ( tag ) { _addTag("host", hostname); }
+        if ( mdl ) {
+            char model[64];
+            size_t modelSize = sizeof(model);
+            if ( sysctlbyname("hw.model", model, &modelSize, NULL, 0) != 0 ) { strcpy(model, "Unknown"); }
+            _addTag("model", model);
+        }
+        strncat(hostTag, extraTags, sizeof(hostTag) - strlen(hostTag) - 1);
+    }
+    
+    // default -a
+    if ( !cpu && !gpu && !fan && !wfi && !ssd && !all && !pwr && !bat ) { cpu = gpu = fan = wfi = ssd = 1; }
+
+    if ( ( anomalySigma > 0.0 || pwr || forecasting || episodeRise > 0.0 || readBudget > 0.0 || maxSeries > 0 ) &&
+         statePath == NULL ) {
+        fprintf(stderr, "Error: -k, -e, -F, -E, -B and -m need a state file from -S\n");
+        return -1;
+    }
+
+    if ( statePath != NULL && loadState(statePath) != 0 ) {
+        fprintf(stderr, "Error: cannot use state file '%s'\n", statePath);
+        return -1;
+    }
+
+    if ( keyCachePath != NULL ) { loadKeyCache(keyCachePath); }
+
+    int sel = ( cpu ? WANT_CPU : 0 ) | ( gpu ? WANT_GPU : 0 ) | ( ssd ? WANT_SSD : 0 ) | ( wfi ? WANT_WIFI : 0 ) |
+              ( fan ? WANT_FAN : 0 ) | ( all ? WANT_ALL : 0 ) | ( bat ? WANT_BATTERY : 0 ) | ( pwr ? WANT_POWER : 0 );
+
+    // picking up from a process that exec'd this one on SIGHUP, if any
+    resumeAt = _handoffRestore();
+
+    // a socket that goes away must not kill the collector
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, _stop);
+    signal(SIGINT, _stop);
+    if ( interval > 0 && !snmpMode ) { signal(SIGHUP, _upgrade); }
+
+    // get SMC values and print in line protocol
+    SMCOpen();
+
+    if ( snmpMode ) {
+        snmpServe(sel, interval > 0 ? interval : 10);
+    } else if ( interval > 0 ) {
+        // fixed rate from a monotonic clock, ticks missed while suspended are skipped rather than bunched up,
+        // after an upgrade the schedule carries on from the tick the old process was waiting for
+        long next = resumeAt > 0 ? resumeAt : _monotonicUs();
+        for (;;) {
+            _sinkRun(next, 0);
+            if ( upgrading ) {
+                _handoff(argv, next);
+                upgrading = 0;
+                running = 1;
+                continue;
+            }
+            if ( !running ) { break; }
+            collect(sel);
+            next += interval * 1000000L;
+            while ( next <= _monotonicUs() ) { next += interval * 1000000L; }
+        }
+    } else {
+        collect(sel);
     }
 
     SMCClose();
 
+    // give the sink a last second to deliver what is queued
+    if ( sinkPath != NULL ) {
+        running = 1;
+        _sinkRun(_monotonicUs() + 1000000, 1);
+        if ( sinkLen > 0 ) {
+            fprintf(stderr, "Error: could not deliver batch to '%s'\n", sinkPath);
+            return 1;
+        }
+    }
+
     return 0;
 }